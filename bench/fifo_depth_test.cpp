@@ -0,0 +1,72 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ *
+ * Checks of the depth controller of the daemon: the depth only changes
+ * while the transmitter is idle, be it to shrink or to grow, since the
+ * sink has to be built again and drops what its FIFO holds.
+ * Exits with a non zero status on the first failure.
+ *
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "fifo_depth.h"
+
+#define SAMPLE_RATE 48000.0
+
+/* As in fifo_depth.cpp */
+#define WINDOW 2.0
+#define SAFE_WINDOWS 5
+
+static int Failures = 0;
+
+static void check(bool condition, const char *what)
+{
+    printf("%s: %s\n", condition ? "ok" : "FAILED", what);
+    if (!condition)
+        Failures++;
+}
+
+/* One window of transmission, the FIFO never holding less than level */
+static bool transmit_window(FifoDepthController &depth, double level)
+{
+    depth.record_level(level * SAMPLE_RATE, SAMPLE_RATE);
+    return depth.update(WINDOW, false);
+}
+
+int main()
+{
+    FifoDepthController depth;
+    bool rebuilt = false;
+    
+    depth.set_budget(360);
+    size_t initial = depth.depth(SAMPLE_RATE);
+    check(initial == 17280, "starts from the budget");
+    
+    /* Only 50 ms of the FIFO used: safe to shrink, once idle */
+    for (int i = 0; i < SAFE_WINDOWS + 2; i++)
+        rebuilt |= transmit_window(depth, 0.31);
+    check(!rebuilt && depth.depth(SAMPLE_RATE) == initial, "no shrink while transmitting");
+    check(depth.update(0, true), "shrinks once idle");
+    size_t shrunk = depth.depth(SAMPLE_RATE);
+    check(shrunk < initial, "depth is smaller");
+    
+    /* The FIFO runs dry in the middle of a transmission */
+    depth.record_underrun();
+    rebuilt = depth.update(WINDOW, false);
+    for (int i = 0; i < SAFE_WINDOWS + 2; i++)
+        rebuilt |= transmit_window(depth, 0.05);
+    check(!rebuilt && depth.depth(SAMPLE_RATE) == shrunk, "no growth while transmitting");
+    check(depth.update(0, true), "grows once idle");
+    size_t grown = depth.depth(SAMPLE_RATE);
+    check(grown >= 2 * shrunk && grown <= 2 * shrunk + 1, "depth is doubled");
+    check(depth.underruns() == 1, "underrun counted");
+    
+    /* Nothing left to apply */
+    check(!depth.update(0, true), "no rebuild without a change");
+    
+    return Failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
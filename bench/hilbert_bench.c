@@ -0,0 +1,44 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Wraps the Q generation of the module for the benchmarks. The source is
+ * included as it is, so that its static parameters can be set.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include "iq_sample_generation.c"
+
+#include "hilbert_bench.h"
+
+int bench_use_simd = 1;
+
+static struct iq_generator generator;
+
+/* There is no monitor PCM here */
+void rpitx_alsa_monitor_iq(const int16_t *iq, size_t frames)
+{
+}
+
+int hilbert_bench_has_neon(void)
+{
+#ifdef CONFIG_KERNEL_MODE_NEON
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void hilbert_bench_reset(int engine, int taps, int neon)
+{
+    hilbert_engine = engine;
+    hilbert_taps = taps;
+    bench_use_simd = neon;
+    clear_iq_sample_generation(&generator);
+}
+
+int hilbert_bench_process(int16_t *out, const int16_t *in, size_t samples)
+{
+    return process_iq_period(&generator, (char *)out, (const char *)in, samples);
+}
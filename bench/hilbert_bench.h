@@ -0,0 +1,39 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * The Q generation of the module (iq_sample_generation.c), built in user
+ * space against the headers of shim/, for the benchmarks.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#ifndef HILBERT_BENCH_H
+#define HILBERT_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Engines, as the hilbert_engine module parameter */
+#define HILBERT_BENCH_FIR 0
+#define HILBERT_BENCH_IIR 1
+
+/* Non-zero when the NEON version of the FIR was built in */
+int hilbert_bench_has_neon(void);
+
+/* Start over with an engine, as when usbdata is opened. taps is that of
+ * the FIR, and neon picks its NEON version when built in. */
+void hilbert_bench_reset(int engine, int taps, int neon);
+
+/* process_iq_period() on samples mono samples, out getting I-Q pairs */
+int hilbert_bench_process(int16_t *out, const int16_t *in, size_t samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
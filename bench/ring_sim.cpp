@@ -0,0 +1,493 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ *
+ * User space simulation of the way from an application to the daemon:
+ *  - the application thread writes periods into an ALSA buffer, at its
+ *    own rate and with a jitter profile, blocking when the buffer is full
+ *  - the clock thread plays the buffer into the FIFO of the module on each
+ *    tick, as rpitx_clock_tick() and play_stream() do
+ *  - the daemon thread reads the FIFO as read_stream() does, at its own
+ *    cadence and with its own jitter profile
+ * The FIFO is sample_fifo.c of the module, built as it is. Every frame
+ * carries its number, so the time from the application to the daemon is
+ * known for each of them. The results are printed as JSON on stdout, so
+ * that buffer geometries and pacings can be compared before trying them
+ * on the air.
+ *
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <random>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+#include <time.h>
+
+extern "C" {
+#include "sample_fifo.h"
+}
+
+/* The shim defines them as macros, for the module */
+#undef min
+#undef min_t
+#undef clamp
+#undef clamp_t
+
+/* Frames of S16 I-Q, as sendiq with most applications */
+#define FRAME_BYTES 4
+
+/* As in alsa_handling.c */
+#define MIN_TICK_NS 500000
+
+/* The daemon polls /dev/rpitxin with that timeout */
+#define POLL_TIMEOUT_MS 100
+
+/* Delays of one thread: each period (or read) is late by up to jitter,
+ * and by stall more with the given probability */
+struct Pacing
+{
+    double jitterUs = 0;
+    double stallMs = 0;
+    double stallProbability = 0;
+};
+
+static struct
+{
+    unsigned int rate = 48000;
+    unsigned int periodSize = 1024;
+    unsigned int periods = 4;
+    unsigned int prefill = 0;            /* Periods written before the start, 0 for all */
+    unsigned int fifoBytes = 131072;
+    double applicationPpm = 0;           /* Clock of the application against the module's */
+    unsigned int burst = 4000;           /* Frames read by the daemon at most, IQBURST */
+    double duration = 10;
+    unsigned int seed = 1;
+    Pacing application, daemon;
+} Config;
+
+/* The ALSA runtime of the substream. Positions are in frames and never
+ * wrap, as ALSA's up to its boundary. Both sides hold Lock to move them. */
+static std::vector<char> Buffer;
+static uint64_t ApplPtr, HwPtr;
+static std::mutex Lock;
+static std::condition_variable PeriodElapsed, DataReady, Started;
+static bool ClockStarted = false;
+static std::atomic<bool> Running(true);
+
+/* The FIFO of the module, between the clock and the daemon */
+static struct sample_fifo Fifo;
+static std::vector<char> FifoData;
+
+/* When each frame was written, by frame number */
+static std::unique_ptr<std::atomic<int64_t>[]> WriteTime;
+static uint64_t WriteTimeMask;
+
+/* Each thread counts on its own, everything is read once they are done */
+static struct
+{
+    uint64_t periods, frames, stalls;
+    int64_t blockedNs;
+} ApplicationStats;
+
+static struct
+{
+    uint64_t ticks, frames, underruns, xruns, droppedFrames;
+    uint32_t maxFill;
+} ClockStats;
+
+static struct
+{
+    uint64_t reads, emptyReads, frames, silentFrames, stalls;
+    std::vector<uint32_t> latencyUs;
+} DaemonStats;
+
+static int64_t monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void sleep_until_ns(int64_t deadline)
+{
+    struct timespec time;
+    time.tv_sec = deadline / 1000000000LL;
+    time.tv_nsec = deadline % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL) == EINTR)
+        ;
+}
+
+/* How late a thread is this time, according to its pacing */
+static int64_t pacing_delay_ns(const Pacing &pacing, std::mt19937 &random, uint64_t &stalls)
+{
+    std::uniform_real_distribution<double> uniform(0, 1);
+    int64_t delay = (int64_t)(uniform(random) * pacing.jitterUs * 1000);
+
+    if (pacing.stallProbability > 0 && uniform(random) < pacing.stallProbability) {
+        delay += (int64_t)(pacing.stallMs * 1000000);
+        stalls++;
+    }
+    return delay;
+}
+
+/* === Application === */
+
+/* Write one period at ApplPtr, each frame holding its number, with Lock held */
+static void write_period()
+{
+    size_t bufferFrames = Buffer.size() / FRAME_BYTES;
+    int64_t now = monotonic_ns();
+
+    for (unsigned int i = 0; i < Config.periodSize; i++) {
+        uint64_t number = ApplPtr + i + 1; /* 0 is silence */
+        int16_t *frame = reinterpret_cast<int16_t *>(&Buffer[((ApplPtr + i) % bufferFrames) * FRAME_BYTES]);
+        frame[0] = (int16_t)(number & 0xffff);
+        frame[1] = (int16_t)((number >> 16) & 0xffff);
+        WriteTime[number & WriteTimeMask].store(now, std::memory_order_relaxed);
+    }
+    ApplPtr += Config.periodSize;
+}
+
+/* Writes periods as a blocking snd_pcm_writei() with avail_min at one
+ * period would, the first ones before the start */
+static void application_thread()
+{
+    std::mt19937 random(Config.seed);
+    size_t bufferFrames = Buffer.size() / FRAME_BYTES;
+    double periodNs = 1e9 * Config.periodSize / (Config.rate * (1 + Config.applicationPpm * 1e-6));
+    int64_t start = 0;
+
+    for (uint64_t period = 0; Running; period++) {
+        if (period >= Config.prefill) {
+            int64_t due = start + (int64_t)((period - Config.prefill) * periodNs);
+            sleep_until_ns(due + pacing_delay_ns(Config.application, random, ApplicationStats.stalls));
+        }
+
+        std::unique_lock<std::mutex> lock(Lock);
+        int64_t blocked = monotonic_ns();
+        PeriodElapsed.wait(lock, [&]() { return !Running || bufferFrames - (ApplPtr - HwPtr) >= Config.periodSize; });
+        if (!Running)
+            break;
+        if (period >= Config.prefill)
+            ApplicationStats.blockedNs += monotonic_ns() - blocked;
+
+        write_period();
+        ApplicationStats.periods++;
+        ApplicationStats.frames += Config.periodSize;
+
+        /* Start threshold reached */
+        if (period + 1 == Config.prefill) {
+            ClockStarted = true;
+            start = monotonic_ns();
+            Started.notify_all();
+        }
+    }
+}
+
+/* === Module === */
+
+/* As copy_to_fifo(): frames found at the hardware pointer, followed by
+ * silent frames. What does not fit is dropped. */
+static void copy_to_fifo(uint64_t frames, uint64_t silence)
+{
+    uint32_t bytes = frames * FRAME_BYTES;
+    uint32_t silentBytes = silence * FRAME_BYTES;
+    uint32_t hwPointer = (HwPtr * FRAME_BYTES) % Buffer.size();
+    uint32_t firstPart = std::min<uint32_t>(bytes, Buffer.size() - hwPointer);
+    uint32_t written;
+
+    written = sample_fifo_write(&Fifo, &Buffer[hwPointer], firstPart);
+    if (written == firstPart)
+        written += sample_fifo_write(&Fifo, &Buffer[0], bytes - firstPart);
+    if (written == bytes)
+        written += sample_fifo_write_silence(&Fifo, silentBytes);
+
+    ClockStats.maxFill = std::max(ClockStats.maxFill, sample_fifo_fill(&Fifo));
+    if (written < bytes + silentBytes)
+        ClockStats.droppedFrames += (bytes + silentBytes - written) / FRAME_BYTES;
+}
+
+/* As play_stream(), with Lock held. The clock plays silence when the
+ * buffer runs dry, and ALSA sees an xrun once the hardware pointer has
+ * caught up with the application. The application starts over from there,
+ * as after snd_pcm_recover(), but without stopping the clock. */
+static void play_stream(uint64_t delta)
+{
+    uint64_t ready = std::min(delta, ApplPtr - HwPtr);
+    bool dry = ApplPtr == HwPtr;
+
+    copy_to_fifo(ready, delta - ready);
+    if (ready < delta)
+        ClockStats.underruns++;
+
+    HwPtr += delta;
+    ClockStats.frames += delta;
+    if (HwPtr >= ApplPtr) {
+        /* Once for each time the buffer runs dry */
+        if (!dry)
+            ClockStats.xruns++;
+        ApplPtr = HwPtr;
+    }
+
+    if (HwPtr / Config.periodSize != (HwPtr - delta) / Config.periodSize)
+        PeriodElapsed.notify_all();
+}
+
+/* As rpitx_clock_tick(), the frames due since the last tick are counted
+ * from a base time, and the timer is forwarded past now */
+static void clock_thread()
+{
+    int64_t tick = std::max<int64_t>((int64_t)Config.periodSize * 1000000000LL / Config.rate, MIN_TICK_NS);
+    int64_t baseTime, next;
+    uint64_t framesSinceBase = 0;
+
+    {
+        std::unique_lock<std::mutex> lock(Lock);
+        Started.wait(lock, []() { return ClockStarted || !Running; });
+    }
+    baseTime = monotonic_ns();
+    next = baseTime + tick;
+
+    while (Running) {
+        sleep_until_ns(next);
+        int64_t now = monotonic_ns();
+        while (next <= now)
+            next += tick;
+
+        uint64_t elapsedNs = now - baseTime;
+        uint64_t frames = elapsedNs * Config.rate / 1000000000ULL;
+        uint64_t delta = frames - framesSinceBase;
+        framesSinceBase = frames;
+        if (elapsedNs >= 1000000000ULL) {
+            baseTime += 1000000000LL;
+            framesSinceBase -= Config.rate;
+        }
+
+        std::lock_guard<std::mutex> lock(Lock);
+        ClockStats.ticks++;
+        play_stream(delta);
+        if (delta)
+            DataReady.notify_all();
+    }
+}
+
+/* === Daemon === */
+
+/* As read_stream(), at most burst frames in one or two parts */
+static void read_fifo()
+{
+    uint32_t bytes = std::min<uint32_t>(sample_fifo_fill(&Fifo) / FRAME_BYTES, Config.burst) * FRAME_BYTES;
+    const char *data;
+    uint32_t part, done;
+
+    DaemonStats.reads++;
+    if (bytes == 0) {
+        DaemonStats.emptyReads++;
+        return;
+    }
+
+    int64_t now = monotonic_ns();
+    for (done = 0; done < bytes; done += part) {
+        part = std::min(sample_fifo_peek(&Fifo, done, &data), bytes - done);
+        for (uint32_t i = 0; i < part; i += FRAME_BYTES) {
+            const int16_t *frame = reinterpret_cast<const int16_t *>(data + i);
+            uint64_t number = (uint16_t)frame[0] | (uint64_t)(uint16_t)frame[1] << 16;
+            if (number == 0) {
+                DaemonStats.silentFrames++;
+                continue;
+            }
+            /* Frame numbers wrap at 32 bits, the write times well before */
+            int64_t written = WriteTime[number & WriteTimeMask].load(std::memory_order_relaxed);
+            DaemonStats.latencyUs.push_back((uint32_t)((now - written) / 1000));
+        }
+    }
+
+    sample_fifo_consume(&Fifo, bytes);
+    DaemonStats.frames += bytes / FRAME_BYTES;
+}
+
+/* Waits for the clock as poll() on /dev/rpitxin, then reads, late by
+ * its pacing */
+static void daemon_thread()
+{
+    std::mt19937 random(Config.seed + 1);
+
+    while (Running) {
+        {
+            std::unique_lock<std::mutex> lock(Lock);
+            DataReady.wait_for(lock, std::chrono::milliseconds(POLL_TIMEOUT_MS),
+                               []() { return !Running || sample_fifo_fill(&Fifo) > 0; });
+        }
+        if (!Running)
+            break;
+
+        int64_t delay = pacing_delay_ns(Config.daemon, random, DaemonStats.stalls);
+        if (delay > 0)
+            sleep_until_ns(monotonic_ns() + delay);
+        read_fifo();
+    }
+}
+
+/* === Report === */
+
+static uint32_t percentile(std::vector<uint32_t> &values, double fraction)
+{
+    if (values.empty())
+        return 0;
+    size_t rank = std::min(values.size() - 1, (size_t)(fraction * values.size()));
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+    return values[rank];
+}
+
+static void print_pacing(const char *name, const Pacing &pacing)
+{
+    printf("    \"%s_jitter_us\": %.0f,\n    \"%s_stall_ms\": %.1f,\n    \"%s_stall_probability\": %g,\n",
+           name, pacing.jitterUs, name, pacing.stallMs, name, pacing.stallProbability);
+}
+
+static void print_report(double seconds)
+{
+    std::vector<uint32_t> &latency = DaemonStats.latencyUs;
+
+    printf("{\n  \"config\": {\n");
+    printf("    \"rate\": %u,\n    \"period_size\": %u,\n    \"periods\": %u,\n    \"prefill\": %u,\n",
+           Config.rate, Config.periodSize, Config.periods, Config.prefill);
+    printf("    \"fifo_bytes\": %u,\n    \"burst\": %u,\n    \"application_ppm\": %g,\n",
+           Config.fifoBytes, Config.burst, Config.applicationPpm);
+    print_pacing("application", Config.application);
+    print_pacing("daemon", Config.daemon);
+    printf("    \"duration_s\": %.3f\n  },\n", seconds);
+
+    printf("  \"application\": {\"periods\": %llu, \"frames_per_second\": %.1f, \"stalls\": %llu, "
+           "\"blocked_ms\": %.1f},\n",
+           (unsigned long long)ApplicationStats.periods, ApplicationStats.frames / seconds,
+           (unsigned long long)ApplicationStats.stalls, ApplicationStats.blockedNs * 1e-6);
+    printf("  \"module\": {\"ticks\": %llu, \"frames_per_second\": %.1f, \"underruns\": %llu, \"xruns\": %llu, "
+           "\"dropped_frames\": %llu, \"max_fifo_fill\": %u},\n",
+           (unsigned long long)ClockStats.ticks, ClockStats.frames / seconds,
+           (unsigned long long)ClockStats.underruns, (unsigned long long)ClockStats.xruns,
+           (unsigned long long)ClockStats.droppedFrames, ClockStats.maxFill);
+    printf("  \"daemon\": {\"reads\": %llu, \"empty_reads\": %llu, \"frames_per_second\": %.1f, "
+           "\"silent_frames\": %llu, \"stalls\": %llu,\n",
+           (unsigned long long)DaemonStats.reads, (unsigned long long)DaemonStats.emptyReads,
+           DaemonStats.frames / seconds, (unsigned long long)DaemonStats.silentFrames,
+           (unsigned long long)DaemonStats.stalls);
+
+    /* From the write of the application to the read of the daemon */
+    printf("    \"latency_us\": {\"p50\": %u, \"p90\": %u, \"p99\": %u, \"p99.9\": %u, \"max\": %u}}\n}\n",
+           percentile(latency, 0.5), percentile(latency, 0.9), percentile(latency, 0.99),
+           percentile(latency, 0.999), percentile(latency, 1));
+}
+
+/* "jitter_us[:stall_ms:probability]" */
+static bool parse_pacing(const char *arg, Pacing &pacing)
+{
+    int fields = sscanf(arg, "%lf:%lf:%lf", &pacing.jitterUs, &pacing.stallMs, &pacing.stallProbability);
+    return fields == 1 || fields == 3;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-r rate] [-p period_frames] [-n periods] [-s prefill_periods] [-f fifo_bytes]\n"
+            "          [-a application_ppm] [-j application_pacing] [-b daemon_burst] [-J daemon_pacing]\n"
+            "          [-d seconds] [-x seed]\n"
+            "A pacing is jitter_us[:stall_ms:stall_probability], e.g. -J 2000:50:0.001\n", name);
+    exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:p:n:s:f:a:j:b:J:d:x:")) != -1) {
+        switch (opt) {
+        case 'r':
+            Config.rate = atoi(optarg);
+            break;
+        case 'p':
+            Config.periodSize = atoi(optarg);
+            break;
+        case 'n':
+            Config.periods = atoi(optarg);
+            break;
+        case 's':
+            Config.prefill = atoi(optarg);
+            break;
+        case 'f':
+            Config.fifoBytes = atoi(optarg);
+            break;
+        case 'a':
+            Config.applicationPpm = atof(optarg);
+            break;
+        case 'j':
+            if (!parse_pacing(optarg, Config.application))
+                usage(argv[0]);
+            break;
+        case 'b':
+            Config.burst = atoi(optarg);
+            break;
+        case 'J':
+            if (!parse_pacing(optarg, Config.daemon))
+                usage(argv[0]);
+            break;
+        case 'd':
+            Config.duration = atof(optarg);
+            break;
+        case 'x':
+            Config.seed = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    /* The FIFO is a power of two, as the module rounds fifo_bytes up */
+    if (Config.rate == 0 || Config.periodSize == 0 || Config.periods < 2 || Config.burst == 0
+        || Config.fifoBytes < FRAME_BYTES || Config.fifoBytes & (Config.fifoBytes - 1)) {
+        fprintf(stderr, "Invalid geometry, the FIFO size must be a power of two\n");
+        usage(argv[0]);
+    }
+    if (Config.prefill == 0 || Config.prefill > Config.periods)
+        Config.prefill = Config.periods;
+
+    Buffer.resize((size_t)Config.periodSize * Config.periods * FRAME_BYTES);
+    FifoData.resize(Config.fifoBytes);
+    sample_fifo_init(&Fifo, FifoData.data(), Config.fifoBytes);
+
+    /* Room for every frame between the application and the daemon */
+    size_t inFlight = 2 * (Buffer.size() + Config.fifoBytes) / FRAME_BYTES;
+    for (WriteTimeMask = 1; WriteTimeMask < inFlight; WriteTimeMask <<= 1)
+        ;
+    WriteTime.reset(new std::atomic<int64_t>[WriteTimeMask]);
+    WriteTimeMask--;
+    DaemonStats.latencyUs.reserve((size_t)(Config.rate * Config.duration * 1.1));
+
+    int64_t start = monotonic_ns();
+    std::thread application(application_thread), clock(clock_thread), daemon(daemon_thread);
+
+    sleep_until_ns(start + (int64_t)(Config.duration * 1e9));
+    {
+        std::lock_guard<std::mutex> lock(Lock);
+        Running = false;
+        PeriodElapsed.notify_all();
+        DataReady.notify_all();
+        Started.notify_all();
+    }
+    application.join();
+    clock.join();
+    daemon.join();
+
+    print_report((monotonic_ns() - start) * 1e-9);
+    return 0;
+}
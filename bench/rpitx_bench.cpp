@@ -0,0 +1,267 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ *
+ * Micro-benchmarks of the hot paths, run on the host CPU:
+ *  - the Q generation of the module, for each engine
+ *  - the conversion of the daemon, for each set of kernels and format
+ *  - the per stream processing of the mixer (conversion, shift, gain)
+ *    and the drift resampler
+ * for several period sizes. The results are printed as JSON on stdout,
+ * so they can be compared from one release to the next.
+ *
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <complex>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "hilbert_bench.h"
+#include "sample_conversion.h"
+#include "resampler.h"
+#include "nco.h"
+#include "mixer.h"
+
+/* Each case runs for at least that long, several times, and the best
+ * run is kept */
+#define MIN_RUN_NS 50000000LL
+#define RUNS 5
+
+/* Samples processed per case, whatever the period size */
+#define BENCH_SAMPLES 65536
+
+static const size_t PeriodSizes[] = { 64, 256, 1024, 4096 };
+static const unsigned int SampleRates[] = { 8000, 48000, 96000, 192000 };
+
+static int cycleCounter = -1;
+static bool firstResult = true;
+
+static int64_t monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* CPU cycles of this thread, through perf. Not available everywhere (e.g.
+ * in containers or with perf_event_paranoid set), then -1. */
+static void open_cycle_counter()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    cycleCounter = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int64_t read_cycles()
+{
+    uint64_t cycles;
+    if (cycleCounter < 0 || read(cycleCounter, &cycles, sizeof(cycles)) != sizeof(cycles))
+        return -1;
+    return cycles;
+}
+
+/* Run one case and print its result. work processes BENCH_SAMPLES samples,
+ * one period at a time. */
+static void run_case(const char *path, const char *engine, const char *format, size_t period,
+                     const std::function<void()> &work)
+{
+    double bestNs = 1e300, bestCycles = -1;
+
+    work(); /* Warm up the caches */
+
+    for (int run = 0; run < RUNS; run++) {
+        int64_t samples = 0;
+        int64_t cyclesStart = read_cycles();
+        int64_t start = monotonic_ns(), elapsed;
+        do {
+            work();
+            samples += BENCH_SAMPLES;
+            elapsed = monotonic_ns() - start;
+        } while (elapsed < MIN_RUN_NS);
+        int64_t cyclesEnd = read_cycles();
+
+        if ((double)elapsed / samples < bestNs) {
+            bestNs = (double)elapsed / samples;
+            bestCycles = cyclesStart >= 0 && cyclesEnd >= 0 ? (double)(cyclesEnd - cyclesStart) / samples : -1;
+        }
+    }
+
+    printf("%s\n    {\"path\": \"%s\", \"engine\": \"%s\", \"format\": \"%s\", \"period\": %zu, "
+           "\"ns_per_sample\": %.3f, \"samples_per_second\": %.0f, ",
+           firstResult ? "" : ",", path, engine, format, period, bestNs, 1e9 / bestNs);
+    if (bestCycles >= 0)
+        printf("\"cycles_per_sample\": %.2f, ", bestCycles);
+    else
+        printf("\"cycles_per_sample\": null, ");
+
+    /* Share of one core needed at each sample rate */
+    printf("\"cpu_load\": {");
+    for (size_t i = 0; i < sizeof(SampleRates) / sizeof(SampleRates[0]); i++)
+        printf("%s\"%u\": %.6f", i ? ", " : "", SampleRates[i], SampleRates[i] * bestNs * 1e-9);
+    printf("}}");
+
+    firstResult = false;
+}
+
+/* A sine wave, so the filters see something realistic */
+template <typename Sample>
+static std::vector<Sample> test_signal(size_t values, double amplitude)
+{
+    std::vector<Sample> signal(values);
+    for (size_t i = 0; i < values; i++)
+        signal[i] = (Sample)(amplitude * std::sin(0.05 * i));
+    return signal;
+}
+
+static void bench_hilbert()
+{
+    std::vector<int16_t> in = test_signal<int16_t>(BENCH_SAMPLES, 10000);
+    std::vector<int16_t> out(2 * BENCH_SAMPLES);
+
+    struct Engine { const char *name; int engine, taps, neon; };
+    std::vector<Engine> engines = {
+        { "fir16", HILBERT_BENCH_FIR, 16, 0 },
+        { "fir32", HILBERT_BENCH_FIR, 32, 0 },
+        { "fir64", HILBERT_BENCH_FIR, 64, 0 },
+        { "iir", HILBERT_BENCH_IIR, 32, 0 },
+    };
+    if (hilbert_bench_has_neon()) {
+        engines.push_back({ "fir16-neon", HILBERT_BENCH_FIR, 16, 1 });
+        engines.push_back({ "fir32-neon", HILBERT_BENCH_FIR, 32, 1 });
+        engines.push_back({ "fir64-neon", HILBERT_BENCH_FIR, 64, 1 });
+    }
+
+    for (const Engine &engine : engines) {
+        for (size_t period : PeriodSizes) {
+            hilbert_bench_reset(engine.engine, engine.taps, engine.neon);
+            run_case("hilbert", engine.name, "S16_LE", period, [&]() {
+                for (size_t i = 0; i < BENCH_SAMPLES; i += period)
+                    hilbert_bench_process(&out[2 * i], &in[i], period);
+            });
+        }
+    }
+}
+
+static void bench_conversion()
+{
+    std::vector<int16_t> s16 = test_signal<int16_t>(2 * BENCH_SAMPLES, 10000);
+    std::vector<int32_t> s32 = test_signal<int32_t>(2 * BENCH_SAMPLES, 1e9);
+    std::vector<std::complex<float>> out(BENCH_SAMPLES);
+    float *outValues = reinterpret_cast<float *>(out.data());
+
+    for (int k = 0; sample_conversion_kernels(k); k++) {
+        const ConversionKernels *kernels = sample_conversion_kernels(k);
+        for (size_t period : PeriodSizes) {
+            run_case("conversion", kernels->name, "S16_LE", period, [&]() {
+                for (size_t i = 0; i < BENCH_SAMPLES; i += period)
+                    kernels->from_s16(outValues + 2 * i, &s16[2 * i], period);
+            });
+            run_case("conversion", kernels->name, "S32_LE", period, [&]() {
+                for (size_t i = 0; i < BENCH_SAMPLES; i += period)
+                    kernels->from_s32(outValues + 2 * i, &s32[2 * i], period);
+            });
+        }
+    }
+}
+
+/* What the daemon does to each stream and burst, with the kernels it picks */
+static void bench_daemon()
+{
+    std::vector<int16_t> s16 = test_signal<int16_t>(2 * BENCH_SAMPLES, 10000);
+    std::vector<int32_t> s32 = test_signal<int32_t>(2 * BENCH_SAMPLES, 1e9);
+    std::vector<float> f32 = test_signal<float>(2 * BENCH_SAMPLES, 0.3);
+    std::vector<std::complex<float>> out(BENCH_SAMPLES), resampled(FractionalResampler::max_output(BENCH_SAMPLES));
+    Nco shift;
+    FractionalResampler resampler;
+
+    shift.set_frequency(0.01);
+    resampler.set_ratio(1.0001);
+
+    for (size_t period : PeriodSizes) {
+        run_case("mixer", sample_conversion_name(), "S16_LE", period, [&]() {
+            for (size_t i = 0; i < BENCH_SAMPLES; i += period) {
+                convert_iq_samples(&out[i], &s16[2 * i], period);
+                shift.process(&out[i], period);
+                scale_samples(&out[i], period, 0.8f);
+            }
+        });
+        run_case("mixer", sample_conversion_name(), "S32_LE", period, [&]() {
+            for (size_t i = 0; i < BENCH_SAMPLES; i += period) {
+                convert_iq_samples(&out[i], &s32[2 * i], period);
+                shift.process(&out[i], period);
+                scale_samples(&out[i], period, 0.8f);
+            }
+        });
+        run_case("mixer", sample_conversion_name(), "FLOAT_LE", period, [&]() {
+            for (size_t i = 0; i < BENCH_SAMPLES; i += period) {
+                convert_iq_samples(&out[i], &f32[2 * i], period);
+                shift.process(&out[i], period);
+                scale_samples(&out[i], period, 0.8f);
+            }
+        });
+        run_case("resampler", "cubic", "FC32", period, [&]() {
+            size_t done = 0;
+            for (size_t i = 0; i < BENCH_SAMPLES; i += period)
+                done += resampler.process(&out[i], period, &resampled[done]);
+        });
+    }
+}
+
+/* Model name of the CPU, for the record */
+static std::string cpu_model()
+{
+    char line[256];
+    std::string model = "unknown";
+
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    if (!cpuinfo)
+        return model;
+
+    while (fgets(line, sizeof(line), cpuinfo)) {
+        if (strncmp(line, "model name", 10) && strncmp(line, "Model", 5))
+            continue;
+        const char *value = strchr(line, ':');
+        if (!value)
+            continue;
+        model = value + 1 + strspn(value + 1, " \t");
+        model.erase(model.find_last_not_of("\n\"\\") + 1);
+        break;
+    }
+
+    fclose(cpuinfo);
+    return model;
+}
+
+int main(int argc, char **argv)
+{
+    init_sample_conversion();
+    open_cycle_counter();
+
+    printf("{\n  \"cpu\": \"%s\",\n  \"cpus\": %ld,\n  \"cycle_counter\": %s,\n  \"results\": [",
+           cpu_model().c_str(), sysconf(_SC_NPROCESSORS_ONLN), cycleCounter >= 0 ? "true" : "false");
+
+    bench_hilbert();
+    bench_conversion();
+    bench_daemon();
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
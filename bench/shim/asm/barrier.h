@@ -0,0 +1,6 @@
+#include <linux/types.h>
+
+/* The SMP barriers of the kernel, as C11 fences */
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
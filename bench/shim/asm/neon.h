@@ -0,0 +1,6 @@
+#include <linux/types.h>
+
+/* User space may always use NEON */
+#define kernel_neon_begin()
+#define kernel_neon_end()
+#define cpu_has_neon() 1
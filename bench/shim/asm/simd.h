@@ -0,0 +1,5 @@
+#include <linux/types.h>
+
+/* Lets the benchmark compare the NEON and plain C versions */
+extern int bench_use_simd;
+#define may_use_simd() bench_use_simd
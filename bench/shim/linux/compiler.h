@@ -0,0 +1,5 @@
+#include <linux/types.h>
+
+/* Single accesses the compiler may not tear or merge */
+#define READ_ONCE(x) (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile __typeof__(x) *)&(x) = (val))
@@ -0,0 +1,8 @@
+#include <linux/types.h>
+#include <math.h>
+
+/* Same result as the kernel's, within rounding: cos(2 * pi * radians / twopi) in Q31 */
+static inline int32_t fixp_cos32_rad(int radians, int twopi)
+{
+    return (int32_t)(cos(2 * M_PI * radians / twopi) * 2147483647.0);
+}
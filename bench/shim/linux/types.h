@@ -0,0 +1,56 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Just enough of the kernel headers to build the sample generation and the
+ * FIFO of the module in user space, for the benchmarks and the simulation.
+ * Every linux/, sound/ and asm/ header of the module found here includes
+ * this one.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#ifndef BENCH_SHIM_TYPES_H
+#define BENCH_SHIM_TYPES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+typedef uint8_t __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+typedef int32_t __s32;
+typedef uint64_t __u64;
+typedef uint32_t u32;
+typedef int64_t s64;
+typedef uint64_t u64;
+
+#define __user
+
+#define S16_MIN (-32768)
+#define S16_MAX 32767
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define clamp(v, lo, hi) ((v) < (lo) ? (lo) : (v) > (hi) ? (hi) : (v))
+#define clamp_t(type, v, lo, hi) clamp((type)(v), (type)(lo), (type)(hi))
+
+/* Module parameters are plain variables */
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+
+/* User space is the same address space here */
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+/* Wait queues and VMAs only appear in declarations */
+typedef int wait_queue_head_t;
+struct vm_area_struct;
+
+#endif
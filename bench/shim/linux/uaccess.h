@@ -0,0 +1 @@
+#include <linux/types.h>
@@ -0,0 +1,122 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Adaptive depth of the output FIFO.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include "fifo_depth.h"
+
+#include <algorithm>
+
+/* Shallowest FIFO, whatever the feeder measures (seconds) */
+#define MIN_DEPTH 0.02
+
+/* A burst is this fraction of the depth, within these bounds (samples) */
+#define BURST_FRACTION 0.25
+#define MIN_BURST 64
+#define MAX_BURST 4000
+
+/* The depth is reconsidered this often (seconds) */
+#define WINDOW 2.0
+
+/* Windows without underrun before shrinking */
+#define SAFE_WINDOWS 5
+
+/* What the feeder used of the depth, or its worst wake-up latency, times
+ * this is considered safe. Smaller changes are not worth a restart. */
+#define MARGIN 2.0
+#define MIN_SHRINK 0.8
+
+/* The worst wake-up latency is forgotten by this factor every window */
+#define JITTER_DECAY 0.9
+
+FifoDepthController::FifoDepthController()
+    : pendingDepth(0), elapsed(0), worstJitter(0), windowJitter(0), safeWindows(0),
+      measured(false), underrun(false), underrunCount(0)
+{
+    set_budget(360);
+}
+
+void FifoDepthController::set_budget(double milliseconds)
+{
+    maxDepth = std::max(milliseconds * 1e-3, MIN_DEPTH);
+    currentDepth = maxDepth;
+    lowestLevel = maxDepth;
+}
+
+size_t FifoDepthController::depth(double sampleRate) const
+{
+    return (size_t)(currentDepth * sampleRate);
+}
+
+size_t FifoDepthController::burst(double sampleRate) const
+{
+    return std::min<size_t>(std::max<size_t>(depth(sampleRate) * BURST_FRACTION, MIN_BURST), MAX_BURST);
+}
+
+void FifoDepthController::record_level(size_t queued, double sampleRate)
+{
+    lowestLevel = std::min(lowestLevel, queued / sampleRate);
+    measured = true;
+}
+
+void FifoDepthController::record_underrun()
+{
+    underrun = true;
+    underrunCount++;
+}
+
+void FifoDepthController::record_jitter(int64_t nanoseconds)
+{
+    windowJitter = std::max(windowJitter, nanoseconds * 1e-9);
+}
+
+bool FifoDepthController::update(double dt, bool idle)
+{
+    elapsed += dt;
+    if (elapsed >= WINDOW)
+        end_window();
+    
+    /* Rebuilding the sink drops what its FIFO holds, so any change waits
+     * for the transmitter to be idle */
+    if (pendingDepth > 0 && idle) {
+        currentDepth = pendingDepth;
+        pendingDepth = 0;
+        safeWindows = 0;
+        return true;
+    }
+    return false;
+}
+
+void FifoDepthController::end_window()
+{
+    bool sent = measured;
+    double used = currentDepth - lowestLevel;
+    
+    elapsed = 0;
+    worstJitter = std::max(windowJitter, worstJitter * JITTER_DECAY);
+    windowJitter = 0;
+    lowestLevel = currentDepth;
+    measured = false;
+    
+    /* Grow from the depth already asked for, if any */
+    if (underrun) {
+        underrun = false;
+        safeWindows = 0;
+        double wanted = std::min(std::max(currentDepth, pendingDepth) * 2, maxDepth);
+        pendingDepth = wanted > currentDepth ? wanted : 0;
+        return;
+    }
+    
+    /* Only windows with samples sent tell anything. A growth still to
+     * be applied is not undone. */
+    if (!sent || ++safeWindows < SAFE_WINDOWS || pendingDepth > currentDepth)
+        return;
+    
+    double wanted = std::max(MARGIN * std::max(used, worstJitter), MIN_DEPTH);
+    if (wanted < currentDepth * MIN_SHRINK)
+        pendingDepth = wanted;
+}
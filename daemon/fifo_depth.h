@@ -0,0 +1,63 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Depth of the FIFO of the output sink, and size of the bursts written to
+ * it. The depth starts from a latency budget, doubles when the FIFO runs
+ * dry, and shrinks towards what the feeder actually needs (its lowest fill
+ * and its worst wake-up latency, with a margin) once it has been safe for
+ * a while. Either change waits for the transmitter to be idle, as the sink
+ * has to be built again. Depths are kept in seconds, so they do not depend
+ * on the sample rate.
+ * Not thread safe: the feeder owns it.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#ifndef FIFO_DEPTH_H
+#define FIFO_DEPTH_H
+
+#include <cstddef>
+#include <cstdint>
+
+class FifoDepthController
+{
+public:
+    FifoDepthController();
+    
+    /* Largest depth allowed, and the starting one, in milliseconds */
+    void set_budget(double milliseconds);
+    double budget() const { return maxDepth * 1e3; }
+    
+    /* In samples, at the given sample rate */
+    size_t depth(double sampleRate) const;
+    size_t burst(double sampleRate) const;
+    
+    /* What the feeder sees: the samples still queued before each write,
+     * an empty FIFO in the middle of a transmission, how late it woke up */
+    void record_level(size_t queued, double sampleRate);
+    void record_underrun();
+    void record_jitter(int64_t nanoseconds);
+    
+    /* Called with the time since the previous call. Returns true when the
+     * sink must be built again with the new depth, which only happens when
+     * idle. */
+    bool update(double dt, bool idle);
+    
+    uint64_t underruns() const { return underrunCount; }
+    
+private:
+    void end_window();
+    
+    double maxDepth, currentDepth, pendingDepth; /* Seconds */
+    double elapsed;
+    double lowestLevel;                          /* Seconds, in this window */
+    double worstJitter;                          /* Seconds, decaying */
+    double windowJitter;
+    int safeWindows;
+    bool measured;                               /* Samples sent in this window */
+    bool underrun;
+    uint64_t underrunCount;
+};
+
+#endif
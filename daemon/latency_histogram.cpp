@@ -0,0 +1,51 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Histogram of scheduling latencies.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include "latency_histogram.h"
+
+#include <algorithm>
+
+LatencyHistogram::LatencyHistogram(const char *name)
+    : name(name), buckets(), count(0), total(0), longest(0)
+{
+}
+
+void LatencyHistogram::add(int64_t nanoseconds)
+{
+    nanoseconds = std::max<int64_t>(nanoseconds, 0);
+    
+    int bucket = 0;
+    for (int64_t us = nanoseconds / 2000; us > 0 && bucket < LATENCY_BUCKETS - 1; us >>= 1)
+        bucket++;
+    
+    buckets[bucket]++;
+    count++;
+    total += nanoseconds;
+    longest = std::max(longest, nanoseconds);
+}
+
+void LatencyHistogram::print(FILE *out) const
+{
+    fprintf(out, "%s: %llu samples, mean %.1f us, max %.1f us\n", name, (unsigned long long)count,
+            count ? total / 1e3 / count : 0.0, longest / 1e3);
+    
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        char range[32];
+        
+        if (!buckets[i])
+            continue;
+        if (i == 0)
+            snprintf(range, sizeof(range), "< 2");
+        else if (i == LATENCY_BUCKETS - 1)
+            snprintf(range, sizeof(range), ">= %d", 1 << i);
+        else
+            snprintf(range, sizeof(range), "%d-%d", 1 << i, 1 << (i + 1));
+        fprintf(out, "  %12s us: %llu\n", range, (unsigned long long)buckets[i]);
+    }
+}
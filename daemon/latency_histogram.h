@@ -0,0 +1,37 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Histogram of durations, in power of two buckets of microseconds, to
+ * check how well the threads are scheduled. Not thread safe: one thread
+ * adds to it and prints it.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <cstdint>
+#include <cstdio>
+
+/* Bucket i counts durations from 2^i to 2^(i+1) us, the first one
+ * everything below 2 us and the last one everything above 32 ms */
+#define LATENCY_BUCKETS 16
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram(const char *name);
+    
+    void add(int64_t nanoseconds);
+    void print(FILE *out) const;
+    
+private:
+    const char *name;
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    int64_t total, longest;
+};
+
+#endif
@@ -3,9 +3,18 @@
  * Author: Kevin "felixzero" Guilloy, F4VQG
  
  * Very basic daemon that reads /dev/rpitxin as a source of I-Q samples
- * and send it to librpitx.
+ * and send it to librpitx, or to another output sink.
  * Largely taken from rpitx's sendiq.cpp file.
  *
+ * Two threads share the work, so that waiting for room in the DMA FIFO
+ * never stops the module from being drained:
+ *  - the main thread reads the streams of the module, mixes them into a
+ *    ring and handles the signals
+ *  - the feeder thread takes them from the ring and hands them to the sink
+ *
+ * Both can be pinned to a core and run with SCHED_FIFO, with all the
+ * memory of the daemon locked, so that nothing else on the Pi delays them.
+ *
  * This file is licensed under GNU GPL v3.
  */
 
@@ -13,117 +22,862 @@
 #include <cstring>
 #include <cstdlib>
 #include <complex>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <atomic>
+#include <thread>
+#include <cerrno>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
-#include <librpitx.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <memory>
+#include "rpitx_ioctl.h"
+#include "sample_conversion.h"
+#include "sample_ring.h"
+#include "resampler.h"
+#include "nco.h"
+#include "mixer.h"
+#include "latency_histogram.h"
+#include "output_sink.h"
+#include "fifo_depth.h"
 
+/* Largest burst of samples, see FifoDepthController::burst() */
 #define IQBURST 4000
 #define INPUT_FILENAME "/dev/rpitxin"
 #define SYSFS_PATH "/sys/devices/rpitx"
 
-static bool running = true, requiresReset = false;
-static float SetFrequency;
+/* Samples between the reader and the feeder, about 0.4 s at 44.1 kHz */
+#define SAMPLE_RING_SIZE 16384
+
+/* Largest offset done by the NCO, as a fraction of the sample rate.
+ * Beyond, the passband of the signal would fold over, so the PLL moves. */
+#define NCO_MAX_SHIFT 0.25
+
+/* Stack touched by each thread at startup when the memory is locked */
+#define PREFAULT_STACK_SIZE (256 * 1024)
+
+/* During the hang time, the DMA FIFO is kept this full of silence, and
+ * topped up this often */
+#define SILENCE_LEVEL_MS 20
+#define SILENCE_POLL_MS 5
+
+static std::atomic<bool> running(true), dumpRequested(false);
+static std::atomic<unsigned int> StreamRate(0), StreamsPlaying(0);
+static bool requiresReset = false;
+static double SetFrequency;
 static float SampleRate = 44100;
 static int Harmonic;
 
-static bool read_frequency_and_harmonic();
-static int read_sys_variable(const char *name);
-static void terminate(int num);
+/* Where the samples go, see output_sink.h */
+static const char *OutputSpec = "rpitx";
+
+/* Written to /sys/devices/rpitx, followed by the feeder */
+static int frequencyFile, harmonicFile, offsetFile, hangTimeFile;
+static std::atomic<int> RequestedFrequency(0), RequestedHarmonic(1), RequestedOffset(0);
+static std::atomic<int> HangTime(0);
+
+static int iqfile;
+static struct rpitx_ring_control *RingControl;
+static const char *Ring;
+
+/* Samples ready for the feeder, and the events waking each thread up */
+static SampleRing<std::complex<float>, SAMPLE_RING_SIZE> Samples;
+static int samplesEvent, spaceEvent;
+
+static FractionalResampler Resampler;
+static DriftController Drift;
+
+/* Depth of the sink's FIFO, owned by the feeder, and the bursts both
+ * threads move at once */
+static FifoDepthController Depth;
+static std::atomic<int> Burst(IQBURST);
+static Nco Shift;
+
+/* Scheduling of the feeder, measured by itself */
+static LatencyHistogram WakeLatency("Feeder wake-up latency");
+static LatencyHistogram FeedDuration("Output write duration");
+static std::atomic<int64_t> SamplesSignaled(0);
+
+/* Frequency shift of each stream of the module, applied by the mixer */
+static Nco StreamShift[RPITX_MAX_STREAMS];
+
+static bool map_ring();
+static bool read_stream_info();
+static void feeder_thread(int cpu, int priority, bool lockMemory);
+static bool wait_samples(int timeout);
+static void signal_event(int event);
+static void clear_event(int event);
+static bool pin_thread(int cpu);
+static bool set_realtime(int priority);
+static void prefault_stack();
+static int64_t monotonic_ns();
+static int mix_streams(std::complex<float> *out, int max);
+static int mix_length();
+static int fetch_stream(uint32_t index, std::complex<float> *out, int max);
+static int read_samples(std::complex<float> *out, int max);
+static int stream_fill_samples(const struct rpitx_stream_control *stream);
+static uint32_t frame_bytes(const struct rpitx_stream_control *stream);
+static void convert_frames(std::complex<float> *out, const char *in, size_t count, uint32_t format);
+static double elapsed_seconds(struct timespec *last);
+static int milliseconds_until(int64_t deadline);
+static void retune(OutputSink &sink);
+static void feed_silence(OutputSink &sink);
+static bool read_tuning();
+static int open_sys_variable(const char *name);
+static int read_sys_variable(int sysfile);
+static int open_signal_fd();
+static void handle_signal(int signalfd);
+static void dump_status();
 
 int main(int argc, char **argv)
 {
-    int iqfile = open(INPUT_FILENAME, O_RDONLY);
+    int readerCpu = -1, feederCpu = -1, priority = 0, opt;
+    bool lockMemory = false;
+    
+    while ((opt = getopt(argc, argv, "r:f:p:lo:L:")) != -1) {
+        switch (opt) {
+        case 'r':
+            readerCpu = atoi(optarg);
+            break;
+        case 'f':
+            feederCpu = atoi(optarg);
+            break;
+        case 'p':
+            priority = atoi(optarg);
+            break;
+        case 'l':
+            lockMemory = true;
+            break;
+        case 'L':
+            Depth.set_budget(atof(optarg));
+            break;
+        case 'o':
+            if (valid_output_sink(optarg)) {
+                OutputSpec = optarg;
+                break;
+            }
+            /* fall through */
+        default:
+            fprintf(stderr, "Usage: %s [-r reader_cpu] [-f feeder_cpu] [-p fifo_priority] [-l] "
+                    "[-o rpitx|null[:rate]|file:path] [-L latency_budget_ms]\n", argv[0]);
+            exit(-1);
+        }
+    }
+    
+    iqfile = open(INPUT_FILENAME, O_RDONLY | O_NONBLOCK);
     if (iqfile < 0) {
         printf("Cannot open input. Are you root?\n");
         exit(-1);
     }
     
-	 for (int i = 0; i < 64; i++) {
-        struct sigaction sa;
-        std::memset(&sa, 0, sizeof(sa));
-        sa.sa_handler = terminate;
-        sigaction(i, &sa, NULL);
+    if (!map_ring())
+        printf("Cannot map the I-Q ring, falling back to read().\n");
+    
+    /* Signals are blocked before the feeder starts, so it inherits the mask */
+    int sigfile = open_signal_fd();
+    if (sigfile < 0) {
+        perror("signalfd");
+        exit(-1);
+    }
+    
+    samplesEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    spaceEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (samplesEvent < 0 || spaceEvent < 0) {
+        perror("eventfd");
+        exit(-1);
     }
 
-    int FifoSize = IQBURST*4;
+    init_sample_conversion();
+    printf("Using %s sample conversion.\n", sample_conversion_name());
+    printf("Sending to %s.\n", OutputSpec);
+
+    frequencyFile = open_sys_variable("frequency");
+    harmonicFile = open_sys_variable("harmonic");
+    offsetFile = open_sys_variable("offset");
+    hangTimeFile = open_sys_variable("hang_time");
+    read_tuning();
+    SetFrequency = RequestedFrequency;
+    Harmonic = RequestedHarmonic;
+    read_stream_info();
+    if (StreamRate)
+        SampleRate = StreamRate;
+    
+    /* Everything mapped so far (the rings, the buffers, librpitx) and
+     * later is faulted in once and for all */
+    if (lockMemory) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+            perror("mlockall");
+        else
+            prefault_stack();
+    }
+    
+    if (readerCpu >= 0 && !pin_thread(readerCpu))
+        fprintf(stderr, "Cannot pin the reader to CPU %d\n", readerCpu);
+    
+    /* The feeder keeps the DMA going, it comes first. The reader has the
+     * whole FIFO of the module ahead of it. */
+    if (priority > 0 && !set_realtime(std::max(priority - 1, 1)))
+        fprintf(stderr, "Cannot set the reader to SCHED_FIFO priority %d\n", std::max(priority - 1, 1));
+    
+    std::thread feeder(feeder_thread, feederCpu, priority, lockMemory);
+    
+    while (running) {
+        struct pollfd fds[7];
+        fds[0].fd = iqfile;
+        /* While the ring is full, samples wait in the module */
+        fds[0].events = Samples.fill() < Samples.capacity() ? POLLIN | POLLPRI : POLLPRI;
+        fds[1].fd = sigfile;
+        fds[1].events = POLLIN;
+        fds[2].fd = spaceEvent;
+        fds[2].events = POLLIN;
+        fds[3].fd = frequencyFile;
+        fds[3].events = POLLPRI;
+        fds[4].fd = harmonicFile;
+        fds[4].events = POLLPRI;
+        fds[5].fd = offsetFile;
+        fds[5].events = POLLPRI;
+        fds[6].fd = hangTimeFile;
+        fds[6].events = POLLPRI;
+        
+        if (poll(fds, 7, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            running = false;
+            break;
+        }
+        
+        if (fds[1].revents & POLLIN)
+            handle_signal(sigfile);
+        
+        if (fds[2].revents & POLLIN)
+            clear_event(spaceEvent);
+        
+        /* Someone retuned, the feeder follows even while idle */
+        if (((fds[3].revents | fds[4].revents | fds[5].revents | fds[6].revents) & (POLLPRI | POLLERR))
+            && read_tuning())
+            signal_event(samplesEvent);
+        
+        /* A new stream was negotiated or started or stopped, the feeder follows */
+        if ((fds[0].revents & POLLPRI) && read_stream_info())
+            signal_event(samplesEvent);
+        
+        /* Move everything the module has into the ring, as far as it fits */
+        size_t fetchedTotal = 0, space;
+        while (running) {
+            std::complex<float> *span = Samples.write_span(space);
+            int fetched = space ? mix_streams(span, std::min<size_t>(space, Burst)) : 0;
+            if (fetched <= 0)
+                break;
+            
+            Samples.commit(fetched);
+            fetchedTotal += fetched;
+        }
+        
+        if (fetchedTotal)
+            signal_event(samplesEvent);
+    }
+    
+    signal_event(samplesEvent);
+    feeder.join();
+    
+    close(samplesEvent);
+    close(spaceEvent);
+    close(sigfile);
+    close(frequencyFile);
+    close(harmonicFile);
+    close(offsetFile);
+    close(hangTimeFile);
+    if (RingControl)
+        munmap(RingControl, getpagesize() * RPITX_MMAP_RING_PGOFF + RingControl->ring_bytes * RingControl->streams);
+    close(iqfile);
+    
+    return 0;
+}
 
-    read_frequency_and_harmonic();
+/* Hands the samples of the ring to the sink, and owns the transmitter */
+static void feeder_thread(int cpu, int priority, bool lockMemory)
+{
+    static std::complex<float> CResampled[FractionalResampler::max_output(IQBURST)];
+    struct timespec lastUpdate, lastDepthUpdate;
+    int64_t tailEnd = 0; /* Nanoseconds, as monotonic_ns() */
+    
+    if (cpu >= 0 && !pin_thread(cpu))
+        fprintf(stderr, "Cannot pin the feeder to CPU %d\n", cpu);
+    if (priority > 0 && !set_realtime(priority))
+        fprintf(stderr, "Cannot set the feeder to SCHED_FIFO priority %d\n", priority);
+    if (lockMemory)
+        prefault_stack();
     
-    std::complex<float> CIQBuffer[IQBURST];
     while (running) {
-        iqdmasync iqtest(SetFrequency, SampleRate, 14, FifoSize, MODE_IQ);
-        iqtest.SetPLLMasterLoop(3, 4, 0);
-        requiresReset = false;        
+        int FifoSize = Depth.depth(SampleRate);
+        std::unique_ptr<OutputSink> sink(create_output_sink(OutputSpec, SetFrequency, SampleRate, FifoSize));
+        if (!sink) {
+            fprintf(stderr, "Cannot open output %s\n", OutputSpec);
+            /* The main thread waits on its signalfd */
+            kill(getpid(), SIGTERM);
+            return;
+        }
+        printf("Output FIFO of %d samples (%.1f ms), bursts of %zu.\n",
+               FifoSize, 1e3 * FifoSize / SampleRate, Depth.burst(SampleRate));
+        Burst = Depth.burst(SampleRate);
+        requiresReset = false;
+        /* Keyed down until samples or a playing stream show up, whatever
+         * the previous sink did. flowing: samples went out back to back
+         * since the last write. */
+        bool transmitting = false, inTail = false, flowing = false;
+        Resampler.reset();
+        Drift.reset();
+        elapsed_seconds(&lastUpdate);
+        elapsed_seconds(&lastDepthUpdate);
 
         while (!requiresReset && running) {
-            int CplxSampleNumber = 0;
-            static short IQBuffer[IQBURST * 2];
-            int nbread = read(iqfile, IQBuffer, sizeof(short) * IQBURST) / sizeof(short);
+            if (dumpRequested.exchange(false))
+                dump_status();
+            
+            /* Resize the FIFO between two transmissions. An unpaced sink
+             * has nothing to measure. */
+            double depthElapsed = elapsed_seconds(&lastDepthUpdate);
+            if (sink->paced() && Depth.update(depthElapsed, !transmitting)) {
+                requiresReset = true;
+                continue;
+            }
+            
+            /* Follow the sample rate of a new stream */
+            if (StreamRate && StreamRate != SampleRate) {
+                printf("Switching to %u Hz sample rate.\n", StreamRate.load());
+                SampleRate = StreamRate;
+                requiresReset = true;
+                continue;
+            }
             
-            if ((nbread > 0) && running) {
-                for(int i = 0; i < nbread/2; i++) {
-                    CIQBuffer[CplxSampleNumber++] =
-                        std::complex<float>(IQBuffer[i*2] / 32768.0,
-                                            IQBuffer[i*2 + 1] / 32768.0);
+            retune(*sink);
+            
+            /* Key up as soon as an application starts, before its first
+             * samples. The drift loop starts over with every transmission. */
+            if (!transmitting && (StreamsPlaying || Samples.fill())) {
+                sink->start();
+                Resampler.reset();
+                Drift.reset();
+                elapsed_seconds(&lastUpdate);
+                transmitting = true;
+            }
+            
+            if (Samples.fill() == 0) {
+                flowing = false;
+                
+                /* Nothing to send until the applications give more */
+                if (!transmitting || StreamsPlaying) {
+                    inTail = false;
+                    wait_samples(-1);
+                    continue;
                 }
                 
-                iqtest.SetIQSamples(CIQBuffer, CplxSampleNumber, Harmonic);
-            } else {
-                iqtest.stop();
-                iqtest.disableclk(4);
+                /* Everything stopped or drained: key down once what the
+                 * DMA FIFO still holds is on the air, and the hang time is
+                 * over. Until then the DMA keeps running on silence, so a
+                 * new transmission starts without any click. */
+                if (!inTail) {
+                    int queued = sink->queued();
+                    tailEnd = monotonic_ns() + (int64_t)(1e9 * queued / SampleRate)
+                              + HangTime * 1000000LL;
+                    inTail = true;
+                }
                 
-                if (read_frequency_and_harmonic())
-                    requiresReset = true;
+                int left = milliseconds_until(tailEnd);
+                if (left > 0) {
+                    feed_silence(*sink);
+                    wait_samples(std::min(left, SILENCE_POLL_MS));
+                    continue;
+                }
+                
+                sink->stop();
+                transmitting = false;
+                inTail = false;
+                continue;
+            }
+            inTail = false;
+            
+            size_t CplxSampleNumber;
+            const std::complex<float> *CIQBuffer = Samples.read_span(CplxSampleNumber);
+            CplxSampleNumber = std::min<size_t>(CplxSampleNumber, Burst);
+            
+            /* An empty FIFO while the samples keep coming means the DMA
+             * ran dry */
+            size_t queued = sink->queued();
+            if (sink->paced()) {
+                if (flowing && queued == 0)
+                    Depth.record_underrun();
+                else
+                    Depth.record_level(queued, SampleRate);
             }
+            
+            /* Samples waiting in the module, in the ring and in the DMA
+             * FIFO tell which of the two clocks is ahead */
+            int downstream = Samples.fill() + queued;
+            Resampler.set_ratio(Drift.update(mix_length() + downstream, SampleRate,
+                                             elapsed_seconds(&lastUpdate)));
+            int ResampledNumber = Resampler.process(CIQBuffer, CplxSampleNumber, CResampled);
+            Shift.process(CResampled, ResampledNumber);
+            
+            Samples.consume(CplxSampleNumber);
+            signal_event(spaceEvent);
+            
+            int64_t feedStart = monotonic_ns();
+            sink->write(CResampled, ResampledNumber, Harmonic);
+            FeedDuration.add(monotonic_ns() - feedStart);
+            transmitting = true;
+            flowing = true;
+            
+            /* Let ALSA count what waits in the ring and the DMA FIFO in its delay */
+            ioctl(iqfile, RPITX_IOC_SET_DELAY, downstream);
+        }
+    }
+}
+
+/* Follow the requested frequency. Offsets within the band are done by
+ * the NCO, anything else moves the PLL, without touching the DMA. */
+static void retune(OutputSink &sink)
+{
+    double NewFrequency = RequestedFrequency;
+    int NewOffset = RequestedOffset;
+    
+    Harmonic = RequestedHarmonic;
+    
+    if (std::abs(NewOffset) <= SampleRate * NCO_MAX_SHIFT) {
+        if (Shift.frequency() != NewOffset / SampleRate)
+            Shift.set_frequency(NewOffset / SampleRate);
+    } else {
+        NewFrequency += NewOffset;
+        if (Shift.frequency() != 0)
+            Shift.set_frequency(0);
+    }
+    
+    if (NewFrequency == SetFrequency)
+        return;
+    
+    SetFrequency = NewFrequency;
+    sink.tune(SetFrequency);
+}
+
+/* Keep a little silence queued in the DMA FIFO, so it never runs dry */
+static void feed_silence(OutputSink &sink)
+{
+    static std::complex<float> Silence[IQBURST];
+    
+    int missing = std::min<int>(SampleRate * SILENCE_LEVEL_MS / 1000, sink.capacity()) - sink.queued();
+    if (missing > 0)
+        sink.write(Silence, std::min(missing, IQBURST), Harmonic);
+}
+
+/* Returns false on timeout. How late the feeder wakes up, after the
+ * timeout or after the event, goes into the histogram. */
+static bool wait_samples(int timeout)
+{
+    struct pollfd fds;
+    fds.fd = samplesEvent;
+    fds.events = POLLIN;
+    
+    int64_t start = monotonic_ns();
+    if (poll(&fds, 1, timeout) == 0) {
+        int64_t late = monotonic_ns() - start - timeout * 1000000LL;
+        WakeLatency.add(late);
+        Depth.record_jitter(late);
+        return false;
+    }
+    
+    clear_event(samplesEvent);
+    int64_t late = monotonic_ns() - std::max<int64_t>(SamplesSignaled, start);
+    WakeLatency.add(late);
+    Depth.record_jitter(late);
+    return true;
+}
+
+static void signal_event(int event)
+{
+    uint64_t one = 1;
+    if (event == samplesEvent)
+        SamplesSignaled = monotonic_ns();
+    
+    /* EAGAIN: the counter is full, the event is pending anyway */
+    while (write(event, &one, sizeof(one)) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            perror("eventfd write");
+        break;
+    }
+}
+
+/* EAGAIN: nothing was pending, the event is clear anyway */
+static void clear_event(int event)
+{
+    uint64_t count;
+    while (read(event, &count, sizeof(count)) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            perror("eventfd read");
+        break;
+    }
+}
+
+/* Run the calling thread with SCHED_FIFO at the given priority */
+static bool set_realtime(int priority)
+{
+    struct sched_param param;
+    param.sched_priority = std::min(priority, sched_get_priority_max(SCHED_FIFO));
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+}
+
+/* Touch the stack of the calling thread, so that it never faults later */
+static void prefault_stack()
+{
+    volatile char stack[PREFAULT_STACK_SIZE];
+    for (size_t i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+static int64_t monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static bool pin_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/* Map the control page and the FIFOs of the module, see rpitx_ioctl.h */
+static bool map_ring()
+{
+    size_t page = getpagesize();
+    void *control = mmap(NULL, page, PROT_READ, MAP_SHARED, iqfile, 0);
+    if (control == MAP_FAILED)
+        return false;
+    
+    size_t capacity = ((struct rpitx_ring_control *)control)->ring_bytes
+                      * ((struct rpitx_ring_control *)control)->streams;
+    munmap(control, page);
+    
+    void *mapping = mmap(NULL, page * RPITX_MMAP_RING_PGOFF + capacity, PROT_READ, MAP_SHARED, iqfile, 0);
+    if (mapping == MAP_FAILED)
+        return false;
+    
+    RingControl = (struct rpitx_ring_control *)mapping;
+    Ring = (const char *)mapping + page * RPITX_MMAP_RING_PGOFF;
+    return true;
+}
+
+/* Returns true if the sample rate or the playing streams changed */
+static bool read_stream_info()
+{
+    struct rpitx_stream_info info;
+    
+    if (ioctl(iqfile, RPITX_IOC_GET_STREAM_INFO, &info) < 0) {
+        perror("RPITX_IOC_GET_STREAM_INFO");
+        return false;
+    }
+    
+    bool changed = info.playing != StreamsPlaying.exchange(info.playing);
+    if (info.rate == 0 || info.rate == StreamRate)
+        return changed;
+    
+    StreamRate = info.rate;
+    return true;
+}
+
+/* Mix at most max samples of the streams of the module into out, each one
+ * shifted and scaled as set by its ALSA controls. Returns how many were
+ * written. Without the control page, only one stream can be read. */
+static int mix_streams(std::complex<float> *out, int max)
+{
+    static std::complex<float> StreamBuffer[IQBURST];
+    
+    if (!RingControl)
+        return read_samples(out, max);
+    
+    int count = std::min(mix_length(), max);
+    if (count == 0)
+        return 0;
+    
+    bool first = true;
+    for (uint32_t i = 0; i < RingControl->streams && i < RPITX_MAX_STREAMS; i++) {
+        struct rpitx_stream_control *stream = &RingControl->stream[i];
+        std::complex<float> *samples = first ? out : StreamBuffer;
+        
+        int fetched = fetch_stream(i, samples, std::min(count, stream_fill_samples(stream)));
+        if (fetched <= 0)
+            continue;
+        
+        double shift = StreamRate ? (double)stream->offset / StreamRate : 0;
+        if (StreamShift[i].frequency() != shift)
+            StreamShift[i].set_frequency(shift);
+        StreamShift[i].process(samples, fetched);
+        
+        /* The first stream goes straight to out, the others are added */
+        if (first) {
+            scale_samples(out, fetched, stream->gain / 100.0f);
+            std::fill(out + fetched, out + count, std::complex<float>(0, 0));
+            first = false;
+        } else {
+            mix_samples(out, StreamBuffer, fetched, stream->gain / 100.0f);
+        }
+    }
+    
+    return first ? 0 : count;
+}
+
+/* The module plays the running and draining streams in step, so all of
+ * them are mixed as far as the one that has the fewest samples. Once none
+ * is playing, what is left in the FIFOs is drained. */
+static int mix_length()
+{
+    int running = INT_MAX, draining = 0;
+    
+    if (!RingControl)
+        return 0;
+    
+    for (uint32_t i = 0; i < RingControl->streams && i < RPITX_MAX_STREAMS; i++) {
+        const struct rpitx_stream_control *stream = &RingControl->stream[i];
+        if (stream->state == RPITX_STATE_RUNNING || stream->state == RPITX_STATE_DRAINING)
+            running = std::min(running, stream_fill_samples(stream));
+        else
+            draining = std::max(draining, stream_fill_samples(stream));
+    }
+    
+    return running != INT_MAX ? running : draining;
+}
+
+/* Get at most max I-Q samples of one stream, converted for librpitx.
+ * I-Q data is taken in place from the FIFO, mono data goes through
+ * RPITX_IOC_READ. */
+static int fetch_stream(uint32_t index, std::complex<float> *out, int max)
+{
+    struct rpitx_stream_control *stream = &RingControl->stream[index];
+    int CplxSampleNumber = 0;
+    
+    if (max <= 0)
+        return 0;
+    
+    if (stream->mode == RPITX_RING_IQ) {
+        const char *ring = Ring + (size_t)index * RingControl->ring_bytes;
+        uint32_t ringBytes = RingControl->ring_bytes;
+        uint32_t consumed = stream->consumed;
+        uint32_t available = __atomic_load_n(&stream->produced, __ATOMIC_ACQUIRE) - consumed;
+        
+        uint32_t frameBytes = frame_bytes(stream);
+        uint32_t bytes = std::min<uint32_t>(available, max * frameBytes);
+        uint32_t offset = consumed % ringBytes;
+        for (uint32_t done = 0; done < bytes; ) {
+            uint32_t chunk = std::min(bytes - done, ringBytes - offset);
+            convert_frames(out + CplxSampleNumber, ring + offset, chunk / frameBytes, stream->format);
+            CplxSampleNumber += chunk / frameBytes;
+            done += chunk;
+            offset = 0;
         }
         
-        iqtest.stop();
+        /* Hand the space back to the module as soon as it has been converted */
+        struct rpitx_consume consume = { index, bytes };
+        if (bytes > 0 && ioctl(iqfile, RPITX_IOC_CONSUME, &consume) < 0)
+            return 0;
+        
+        return CplxSampleNumber;
     }
     
-    close(iqfile);
+    static int16_t IQBuffer[IQBURST * 2];
+    struct rpitx_read request = { index, (uint32_t)(sizeof(int16_t) * 2 * max), (uintptr_t)IQBuffer };
+    int nbread = ioctl(iqfile, RPITX_IOC_READ, &request);
+    if (nbread <= 0)
+        return 0;
     
-    return 0;
+    CplxSampleNumber = nbread / (2 * sizeof(int16_t));
+    convert_iq_samples(out, IQBuffer, CplxSampleNumber);
+    
+    return CplxSampleNumber;
 }
 
-static bool read_frequency_and_harmonic()
+/* Get at most max I-Q samples through read(). Without the control page the
+ * format is unknown, so the streams have to be S16. */
+static int read_samples(std::complex<float> *out, int max)
 {
-    float NewFrequency, NewHarmonic;
+    static int16_t IQBuffer[IQBURST * 2];
+    int nbread = read(iqfile, IQBuffer, sizeof(int16_t) * 2 * max);
+    if (nbread <= 0)
+        return 0;
     
-    NewFrequency = (float)read_sys_variable("frequency");
-    NewHarmonic = read_sys_variable("harmonic");
+    int CplxSampleNumber = nbread / (2 * sizeof(int16_t));
+    convert_iq_samples(out, IQBuffer, CplxSampleNumber);
     
-    if ((NewFrequency != SetFrequency) || (NewHarmonic != Harmonic)) {
-        SetFrequency = NewFrequency;
-        Harmonic = NewHarmonic;
+    return CplxSampleNumber;
+}
+
+/* Samples received by the module but not read yet */
+static int stream_fill_samples(const struct rpitx_stream_control *stream)
+{
+    if (stream->mode == RPITX_RING_NONE)
+        return 0;
+    return (stream->produced - stream->consumed) / frame_bytes(stream);
+}
+
+/* Bytes of one frame in the FIFO of a stream */
+static uint32_t frame_bytes(const struct rpitx_stream_control *stream)
+{
+    if (stream->mode == RPITX_RING_USB)
+        return sizeof(int16_t);
+    if (stream->format == RPITX_FORMAT_S16_LE)
+        return 2 * sizeof(int16_t);
+    return 2 * sizeof(int32_t);
+}
+
+/* Convert count I-Q frames of the given RPITX_FORMAT_* */
+static void convert_frames(std::complex<float> *out, const char *in, size_t count, uint32_t format)
+{
+    switch (format) {
+    case RPITX_FORMAT_S32_LE:
+        convert_iq_samples(out, (const int32_t *)in, count);
+        break;
+    case RPITX_FORMAT_FLOAT_LE:
+        convert_iq_samples(out, (const float *)in, count);
+        break;
+    default:
+        convert_iq_samples(out, (const int16_t *)in, count);
+    }
+}
+
+/* Milliseconds left until deadline (as monotonic_ns()), rounded up, for poll() */
+static int milliseconds_until(int64_t deadline)
+{
+    int64_t left = deadline - monotonic_ns();
+    if (left <= 0)
+        return 0;
+    return (int)std::min<int64_t>((left + 999999) / 1000000, INT_MAX);
+}
+
+/* Seconds since *last, which is then set to now */
+static double elapsed_seconds(struct timespec *last)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    double elapsed = (now.tv_sec - last->tv_sec) + (now.tv_nsec - last->tv_nsec) * 1e-9;
+    *last = now;
+    return elapsed;
+}
+
+/* Returns true if the frequency, the harmonic or the offset changed */
+static bool read_tuning()
+{
+    int NewFrequency, NewHarmonic, NewOffset;
+    
+    /* The feeder reads it when it goes idle, nothing to wake up for */
+    HangTime = std::max(read_sys_variable(hangTimeFile), 0);
+    
+    NewFrequency = read_sys_variable(frequencyFile);
+    NewHarmonic = read_sys_variable(harmonicFile);
+    NewOffset = read_sys_variable(offsetFile);
+    
+    if ((NewFrequency != RequestedFrequency) || (NewHarmonic != RequestedHarmonic)
+        || (NewOffset != RequestedOffset)) {
+        RequestedFrequency = NewFrequency;
+        RequestedHarmonic = NewHarmonic;
+        RequestedOffset = NewOffset;
         return true;
     }
     
     return false;
 }
 
-static int read_sys_variable(const char *name)
+/* The files stay open, the module signals changes with POLLPRI */
+static int open_sys_variable(const char *name)
 {
     char filepath[128];
-    char buffer[128];
-    int output = 0;
-
+    
     sprintf(filepath, "%s/%s", SYSFS_PATH, name);
-    FILE *sysfile = fopen(filepath, "r");
-    if (!sysfile) {
+    int sysfile = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (sysfile < 0) {
         printf("No /sys/devices/rpitx file found.\n");
         exit(-1);
     }
     
-    fread(buffer, 1, 128, sysfile);
-    output = atoi(buffer);
-    fclose(sysfile);
+    return sysfile;
+}
+
+/* Reading the whole file again also re-arms POLLPRI */
+static int read_sys_variable(int sysfile)
+{
+    char buffer[128];
+    
+    ssize_t length = pread(sysfile, buffer, sizeof(buffer) - 1, 0);
+    if (length < 0)
+        return 0;
+    buffer[length] = '\0';
     
-    return output;
+    return atoi(buffer);
 }
 
-static void terminate(int num)
+/* Signals are blocked and delivered through a file descriptor instead,
+ * so they wake up the main poll() loop like any other event. */
+static int open_signal_fd()
 {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGUSR1);
+    
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+        return -1;
+    
+    return signalfd(-1, &mask, SFD_CLOEXEC);
+}
+
+/* SIGUSR1 dumps the status, any other signal terminates the daemon */
+static void handle_signal(int signalfd)
+{
+    struct signalfd_siginfo info;
+    
+    if (read(signalfd, &info, sizeof(info)) != sizeof(info))
+        return;
+    
+    /* The status belongs to the feeder, which prints it */
+    if (info.ssi_signo == SIGUSR1) {
+        dumpRequested = true;
+        signal_event(samplesEvent);
+        return;
+    }
+    
     running = false;
-    fprintf(stderr, "Caught signal - Terminating %x\n", num);
+    fprintf(stderr, "Caught signal - Terminating %x\n", info.ssi_signo);
+}
+
+static void dump_status()
+{
+    fprintf(stderr, "Drift compensation: %s, ratio %+.3f ppm, fill %.0f samples (setpoint %.0f)\n",
+            Drift.locked() ? "locked" : "settling",
+            (Drift.ratio() - 1.0) * 1e6, Drift.fill(), Drift.setpoint());
+    fprintf(stderr, "Sample ring: %zu of %zu samples used, high-water mark %zu\n",
+            Samples.fill(), Samples.capacity(), Samples.high_water());
+    fprintf(stderr, "Output FIFO: %zu samples (%.1f ms, budget %.0f ms), bursts of %zu, %llu underruns\n",
+            Depth.depth(SampleRate), 1e3 * Depth.depth(SampleRate) / SampleRate, Depth.budget(),
+            Depth.burst(SampleRate), (unsigned long long)Depth.underruns());
+    fprintf(stderr, "Latency from the module to the antenna: %.1f ms\n", 1e3 * Drift.fill() / SampleRate);
+    WakeLatency.print(stderr);
+    FeedDuration.print(stderr);
 }
@@ -0,0 +1,33 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Mixing of the streams played at the same time.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include "mixer.h"
+
+/* Complex samples are handled as twice as many floats, I and Q being
+ * scaled alike, so each loop is a single vector multiply(-add). */
+
+void scale_samples(std::complex<float> *samples, size_t count, float gain)
+{
+    float *values = reinterpret_cast<float *>(samples);
+    
+    if (gain == 1.0f)
+        return;
+    
+    for (size_t i = 0; i < 2 * count; i++)
+        values[i] *= gain;
+}
+
+void mix_samples(std::complex<float> *out, const std::complex<float> *in, size_t count, float gain)
+{
+    float *outValues = reinterpret_cast<float *>(out);
+    const float *inValues = reinterpret_cast<const float *>(in);
+    
+    for (size_t i = 0; i < 2 * count; i++)
+        outValues[i] += gain * inValues[i];
+}
@@ -0,0 +1,23 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Mixing of the streams played at the same time into one I-Q signal.
+ * The loops are plain enough for the compiler to vectorize them.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#ifndef MIXER_H
+#define MIXER_H
+
+#include <complex>
+#include <cstddef>
+
+/* Multiply count samples by gain, in place */
+void scale_samples(std::complex<float> *samples, size_t count, float gain);
+
+/* Add count samples of in, multiplied by gain, to out */
+void mix_samples(std::complex<float> *out, const std::complex<float> *in, size_t count, float gain);
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Numerically controlled oscillator for digital retunes.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include "nco.h"
+
+#include <cmath>
+
+Nco::Nco()
+{
+    phase = 0;
+    set_frequency(0);
+}
+
+void Nco::set_frequency(double cyclesPerSample)
+{
+    cycles = cyclesPerSample;
+    stepRe = cos(2 * M_PI * NCO_LANES * cycles);
+    stepIm = sin(2 * M_PI * NCO_LANES * cycles);
+}
+
+/*
+ * The phasors of NCO_LANES consecutive samples are computed exactly from
+ * the phase at the start of each block, then turned by stepRe/stepIm
+ * from one group of samples to the next. The lanes are independent, so
+ * the inner loops map onto SIMD registers.
+ */
+void Nco::process(std::complex<float> *samples, size_t count)
+{
+    float re[NCO_LANES], im[NCO_LANES];
+    float *iq = reinterpret_cast<float *>(samples);
+    size_t n = 0;
+    
+    if (cycles == 0)
+        return;
+    
+    for (int i = 0; i < NCO_LANES; i++) {
+        re[i] = cos(2 * M_PI * (phase + i * cycles));
+        im[i] = sin(2 * M_PI * (phase + i * cycles));
+    }
+    
+    for (; n + NCO_LANES <= count; n += NCO_LANES) {
+        float *block = iq + 2 * n;
+        for (int i = 0; i < NCO_LANES; i++) {
+            float sampleRe = block[2 * i], sampleIm = block[2 * i + 1];
+            block[2 * i] = sampleRe * re[i] - sampleIm * im[i];
+            block[2 * i + 1] = sampleRe * im[i] + sampleIm * re[i];
+        }
+        for (int i = 0; i < NCO_LANES; i++) {
+            float nextRe = re[i] * stepRe - im[i] * stepIm;
+            im[i] = re[i] * stepIm + im[i] * stepRe;
+            re[i] = nextRe;
+        }
+    }
+    
+    /* Leftover samples take the first lanes */
+    for (int i = 0; n + i < count; i++) {
+        float *sample = iq + 2 * (n + i);
+        float sampleRe = sample[0], sampleIm = sample[1];
+        sample[0] = sampleRe * re[i] - sampleIm * im[i];
+        sample[1] = sampleRe * im[i] + sampleIm * re[i];
+    }
+    
+    phase = fmod(phase + count * cycles, 1.0);
+}
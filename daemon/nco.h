@@ -0,0 +1,41 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Numerically controlled oscillator shifting I-Q samples in frequency,
+ * so small retunes do not need to move the PLL. The phase carries over
+ * from one block to the next, and across frequency changes.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#ifndef NCO_H
+#define NCO_H
+
+#include <complex>
+#include <cstddef>
+
+/* Samples rotated together, one vector register or two */
+#define NCO_LANES 8
+
+class Nco
+{
+public:
+    Nco();
+    
+    /* Shift in cycles per sample, between -0.5 and 0.5 */
+    void set_frequency(double cyclesPerSample);
+    double frequency() const { return cycles; }
+    
+    /* Shift samples in place */
+    void process(std::complex<float> *samples, size_t count);
+    
+private:
+    double cycles;
+    double phase; /* Of the next sample, in cycles */
+    
+    /* Rotation by NCO_LANES samples */
+    float stepRe, stepIm;
+};
+
+#endif
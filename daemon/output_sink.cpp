@@ -0,0 +1,285 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Output sinks: librpitx, null and file.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include "output_sink.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <librpitx.h>
+
+/* GPIO of the transmitter clock */
+#define CLOCK_GPIO 4
+
+/* The file sink grows its mapping by that many bytes at a time */
+#define FILE_CHUNK_BYTES (16 << 20)
+
+/* === librpitx === */
+
+class RpitxSink : public OutputSink
+{
+public:
+    RpitxSink(double frequency, float sampleRate, size_t fifoSize)
+        : dma(frequency, sampleRate, 14, fifoSize, MODE_IQ), sampleRate(sampleRate), fifoSize(fifoSize)
+    {
+        dma.SetPLLMasterLoop(3, 4, 0);
+        /* Off the air until start() */
+        dma.disableclk(CLOCK_GPIO);
+    }
+    
+    ~RpitxSink()
+    {
+        dma.stop();
+    }
+    
+    void start()
+    {
+        dma.enableclk(CLOCK_GPIO);
+    }
+    
+    void stop()
+    {
+        dma.stop();
+        dma.disableclk(CLOCK_GPIO);
+    }
+    
+    /* iqdmasync also inherits SetFrequency() from pwmgpio and pcmgpio,
+     * the carrier is the one of clkgpio */
+    void tune(double frequency)
+    {
+        dma.clkgpio::SetCenterFrequency(frequency, sampleRate);
+        dma.clkgpio::SetFrequency(0);
+    }
+    
+    size_t queued()
+    {
+        return fifoSize - std::min<size_t>(std::max(dma.GetBufferAvailable(), 0), fifoSize);
+    }
+    
+    size_t capacity() const
+    {
+        return fifoSize;
+    }
+    
+    bool paced() const
+    {
+        return true;
+    }
+    
+    void write(std::complex<float> *samples, size_t count, int harmonic)
+    {
+        dma.SetIQSamples(samples, count, harmonic);
+    }
+    
+private:
+    iqdmasync dma;
+    float sampleRate;
+    size_t fifoSize;
+};
+
+/* === Paced sinks === */
+
+/* Behaves as a DMA FIFO emptied at rate samples per second, or at once
+ * if rate is 0. What the samples become is up to the subclass. */
+class PacedSink : public OutputSink
+{
+public:
+    PacedSink(double rate, size_t fifoSize)
+        : rate(rate), fifoSize(fifoSize), fill(0)
+    {
+        last = now();
+    }
+    
+    void start() {}
+    
+    void stop()
+    {
+        fill = 0;
+    }
+    
+    void tune(double frequency) {}
+    
+    size_t queued()
+    {
+        drain();
+        return (size_t)fill;
+    }
+    
+    size_t capacity() const
+    {
+        return fifoSize;
+    }
+    
+    bool paced() const
+    {
+        return rate > 0;
+    }
+    
+    void write(std::complex<float> *samples, size_t count, int harmonic)
+    {
+        /* Sleep until the FIFO has room, as SetIQSamples() does */
+        drain();
+        double excess = fill + count - fifoSize;
+        if (rate > 0 && excess > 0) {
+            struct timespec delay;
+            double seconds = excess / rate;
+            delay.tv_sec = (time_t)seconds;
+            delay.tv_nsec = (long)((seconds - delay.tv_sec) * 1e9);
+            nanosleep(&delay, NULL);
+            drain();
+        }
+        
+        output(samples, count);
+        if (rate > 0)
+            fill += count;
+    }
+    
+protected:
+    virtual void output(const std::complex<float> *samples, size_t count) = 0;
+    
+private:
+    static double now()
+    {
+        struct timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return time.tv_sec + time.tv_nsec * 1e-9;
+    }
+    
+    void drain()
+    {
+        double current = now();
+        fill = std::max(fill - (current - last) * rate, 0.0);
+        last = current;
+    }
+    
+    double rate;
+    size_t fifoSize;
+    double fill, last;
+};
+
+class NullSink : public PacedSink
+{
+public:
+    NullSink(double rate, size_t fifoSize) : PacedSink(rate, fifoSize) {}
+    
+protected:
+    void output(const std::complex<float> *samples, size_t count) {}
+};
+
+/* Raw interleaved float I-Q, as read by sendiq -t float. The file is
+ * written through a mapping, grown as needed, and cut to size at the end. */
+class FileSink : public PacedSink
+{
+public:
+    FileSink(const char *path, double rate, size_t fifoSize)
+        : PacedSink(rate, fifoSize), mapping(NULL), mapped(0), used(0)
+    {
+        /* The sink is built again on every rate change: only the first
+         * one of the daemon starts a new file */
+        static bool truncated = false;
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (truncated ? 0 : O_TRUNC), 0644);
+        truncated = true;
+        if (fd < 0) {
+            perror(path);
+            return;
+        }
+        
+        used = lseek(fd, 0, SEEK_END);
+    }
+    
+    ~FileSink()
+    {
+        if (mapping)
+            munmap(mapping, mapped);
+        if (fd >= 0) {
+            if (ftruncate(fd, used) < 0)
+                perror("ftruncate");
+            close(fd);
+        }
+    }
+    
+    bool opened() const
+    {
+        return fd >= 0;
+    }
+    
+protected:
+    void output(const std::complex<float> *samples, size_t count)
+    {
+        size_t bytes = count * sizeof(std::complex<float>);
+        if (fd < 0 || !reserve(used + bytes))
+            return;
+        
+        memcpy(mapping + used, samples, bytes);
+        used += bytes;
+    }
+    
+private:
+    /* Make the file and its mapping at least size bytes long */
+    bool reserve(size_t size)
+    {
+        if (size <= mapped)
+            return true;
+        
+        size_t length = (size + FILE_CHUNK_BYTES - 1) / FILE_CHUNK_BYTES * FILE_CHUNK_BYTES;
+        if (ftruncate(fd, length) < 0) {
+            perror("ftruncate");
+            return false;
+        }
+        
+        void *grown = mapping ? mremap(mapping, mapped, length, MREMAP_MAYMOVE)
+                              : mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (grown == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+        
+        mapping = (char *)grown;
+        mapped = length;
+        return true;
+    }
+    
+    int fd;
+    char *mapping;
+    size_t mapped, used;
+};
+
+/* === Factory === */
+
+bool valid_output_sink(const char *spec)
+{
+    return !strcmp(spec, "rpitx") || !strcmp(spec, "null") || !strncmp(spec, "null:", 5)
+           || (!strncmp(spec, "file:", 5) && spec[5]);
+}
+
+OutputSink *create_output_sink(const char *spec, double frequency, float sampleRate, size_t fifoSize)
+{
+    if (!strcmp(spec, "rpitx"))
+        return new RpitxSink(frequency, sampleRate, fifoSize);
+    
+    if (!strcmp(spec, "null"))
+        return new NullSink(sampleRate, fifoSize);
+    
+    if (!strncmp(spec, "null:", 5))
+        return new NullSink(atof(spec + 5), fifoSize);
+    
+    if (!strncmp(spec, "file:", 5)) {
+        FileSink *sink = new FileSink(spec + 5, sampleRate, fifoSize);
+        if (sink->opened())
+            return sink;
+        delete sink;
+    }
+    
+    return NULL;
+}
@@ -0,0 +1,54 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Where the feeder sends the I-Q samples. Besides librpitx, samples can go
+ * to a null sink, which only takes them at a given pace, or to a file in
+ * the raw complex float format of rpitx's sendiq, so that the daemon can
+ * be loaded and checked on any Linux machine.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include <complex>
+#include <cstddef>
+
+class OutputSink
+{
+public:
+    virtual ~OutputSink() {}
+    
+    /* Key up, and down, dropping what is still queued */
+    virtual void start() = 0;
+    virtual void stop() = 0;
+    
+    /* Move the center frequency, in Hz */
+    virtual void tune(double frequency) = 0;
+    
+    /* Samples queued, not sent yet, out of capacity() */
+    virtual size_t queued() = 0;
+    virtual size_t capacity() const = 0;
+    
+    /* False when the samples are taken as fast as they come: queued()
+     * then says nothing about the FIFO running dry */
+    virtual bool paced() const = 0;
+    
+    /* Queue count samples, waiting for room if needed */
+    virtual void write(std::complex<float> *samples, size_t count, int harmonic) = 0;
+};
+
+/* Returns false if spec does not name a sink:
+ *  - "rpitx": librpitx, the default
+ *  - "null" or "null:<rate>": takes samples at the sample rate, or at
+ *    rate samples per second, 0 for as fast as they come
+ *  - "file:<path>": writes them to path, at the sample rate */
+bool valid_output_sink(const char *spec);
+
+/* Build the sink named by spec, with a FIFO of fifoSize samples. Returns
+ * NULL if it cannot be set up. */
+OutputSink *create_output_sink(const char *spec, double frequency, float sampleRate, size_t fifoSize);
+
+#endif
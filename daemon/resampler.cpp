@@ -0,0 +1,117 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Drift compensation between the ALSA and the DMA clocks.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include "resampler.h"
+
+#include <algorithm>
+
+/* Time constant of the fill level smoothing, in seconds */
+#define FILL_TIME_CONSTANT 1.0
+/* Time after which the average fill becomes the setpoint, in seconds */
+#define SETTLE_TIME 2.0
+/* Gains of the PI loop, the error being expressed in seconds of samples:
+ * a 1 ms excess speeds consumption up by 10 ppm, and the integral
+ * catches up with a steady drift in about 100 s. */
+#define PROPORTIONAL_GAIN 1e-2
+#define INTEGRAL_GAIN 1e-4
+
+/* === FractionalResampler === */
+
+FractionalResampler::FractionalResampler()
+{
+    step = 1.0;
+    reset();
+}
+
+void FractionalResampler::reset()
+{
+    for (int i = 0; i < 4; i++)
+        history[i] = 0;
+    phase = 0;
+}
+
+void FractionalResampler::set_ratio(double ratio)
+{
+    double limit = MAX_DRIFT_PPM * 1e-6;
+    step = 1.0 / std::min(std::max(ratio, 1.0 - limit), 1.0 + limit);
+}
+
+size_t FractionalResampler::process(const std::complex<float> *in, size_t count, std::complex<float> *out)
+{
+    size_t written = 0;
+    
+    for (size_t i = 0; i < count; i++) {
+        history[0] = history[1];
+        history[1] = history[2];
+        history[2] = history[3];
+        history[3] = in[i];
+        
+        /* Catmull-Rom coefficients, between history[1] and history[2] */
+        std::complex<float> c0 = history[1];
+        std::complex<float> c1 = 0.5f * (history[2] - history[0]);
+        std::complex<float> c2 = history[0] - 2.5f * history[1] + 2.0f * history[2] - 0.5f * history[3];
+        std::complex<float> c3 = 0.5f * (history[3] - history[0]) + 1.5f * (history[1] - history[2]);
+        
+        for (; phase < 1.0; phase += step) {
+            float mu = phase;
+            out[written++] = ((c3 * mu + c2) * mu + c1) * mu + c0;
+        }
+        phase -= 1.0;
+    }
+    
+    return written;
+}
+
+/* === DriftController === */
+
+DriftController::DriftController()
+{
+    reset();
+}
+
+void DriftController::reset()
+{
+    smoothedFill = 0;
+    fillSetpoint = 0;
+    integral = 0;
+    currentRatio = 1.0;
+    elapsed = 0;
+    isLocked = false;
+}
+
+double DriftController::update(double fill, double sampleRate, double dt)
+{
+    double limit = MAX_DRIFT_PPM * 1e-6;
+    
+    if (dt <= 0 || sampleRate <= 0)
+        return currentRatio;
+    
+    if (elapsed == 0)
+        smoothedFill = fill;
+    else
+        smoothedFill += (fill - smoothedFill) * dt / (FILL_TIME_CONSTANT + dt);
+    elapsed += dt;
+    
+    /* The natural operating point of the buffers becomes the target */
+    if (!isLocked) {
+        if (elapsed < SETTLE_TIME)
+            return currentRatio;
+        fillSetpoint = smoothedFill;
+        isLocked = true;
+    }
+    
+    /* More buffered than wanted: output fewer samples per input */
+    double error = (smoothedFill - fillSetpoint) / sampleRate;
+    integral = std::min(std::max(integral + INTEGRAL_GAIN * error * dt, -limit), limit);
+    
+    double correction = std::min(std::max(PROPORTIONAL_GAIN * error + integral, -limit), limit);
+    currentRatio = 1.0 - correction;
+    
+    return currentRatio;
+}
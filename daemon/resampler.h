@@ -0,0 +1,73 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Drift compensation between the clock of the application writing to
+ * ALSA and the clock of the DMA (derived from the PLL).
+ * FractionalResampler changes the sample rate by a ratio very close to 1,
+ * and DriftController computes that ratio from how full the buffers
+ * between the application and the DMA are.
+ * Neither allocates memory once constructed.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <complex>
+#include <cstddef>
+
+/* Largest correction applied, in parts per million */
+#define MAX_DRIFT_PPM 500
+
+class FractionalResampler
+{
+public:
+    FractionalResampler();
+    
+    void reset();
+    
+    /* Number of output samples per input sample */
+    void set_ratio(double ratio);
+    double ratio() const { return 1.0 / step; }
+    
+    /* Resample count samples of in to out, returns the number written.
+     * out must hold at least max_output(count) samples. */
+    size_t process(const std::complex<float> *in, size_t count, std::complex<float> *out);
+    static constexpr size_t max_output(size_t count) { return count + count / 1000 + 2; }
+    
+private:
+    /* Last 4 input samples, the output being interpolated between the
+     * two middle ones (cubic Hermite, so 2 samples of delay) */
+    std::complex<float> history[4];
+    double step;  /* Input samples per output sample */
+    double phase; /* Position of the next output after history[1] */
+};
+
+class DriftController
+{
+public:
+    DriftController();
+    
+    void reset();
+    
+    /* Feed the number of samples buffered ahead of the antenna, the sample
+     * rate and the time since the previous update. Returns the new ratio. */
+    double update(double fill, double sampleRate, double dt);
+    
+    double ratio() const { return currentRatio; }
+    double fill() const { return smoothedFill; }
+    double setpoint() const { return fillSetpoint; }
+    bool locked() const { return isLocked; }
+    
+private:
+    double smoothedFill;
+    double fillSetpoint;
+    double integral;
+    double currentRatio;
+    double elapsed;
+    bool isLocked;
+};
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Conversion of interleaved I-Q samples to complex floats, with the
+ * scalar and x86 kernels and the run time selection.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include "sample_conversion.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define S16_SCALE (1.0f / 32768.0f)
+#define S32_SCALE (1.0f / 2147483648.0f)
+
+/* === Scalar kernels === */
+
+template <typename Sample>
+static void convert_scalar(float *out, const Sample *in, size_t count, float scale)
+{
+    for (size_t i = 0; i < 2 * count; i++)
+        out[i] = in[i] * scale;
+}
+
+static void s16_scalar(float *out, const int16_t *in, size_t count)
+{
+    convert_scalar(out, in, count, S16_SCALE);
+}
+
+static void s32_scalar(float *out, const int32_t *in, size_t count)
+{
+    convert_scalar(out, in, count, S32_SCALE);
+}
+
+static const ConversionKernels scalar_kernels = { "scalar", s16_scalar, s32_scalar };
+
+/* === x86 kernels, mostly so that the daemon can be benchmarked on a PC === */
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void s16_sse2(float *out, const int16_t *in, size_t count)
+{
+    const __m128 scale = _mm_set1_ps(S16_SCALE);
+    size_t i = 0;
+    
+    for (; i + 8 <= 2 * count; i += 8) {
+        __m128i samples = _mm_loadu_si128((const __m128i *)(in + i));
+        /* Sign extend by moving each value to the top half, then shifting back */
+        __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+        __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+    }
+    
+    convert_scalar(out + i, in + i, (2 * count - i) / 2, S16_SCALE);
+}
+
+__attribute__((target("sse2")))
+static void s32_sse2(float *out, const int32_t *in, size_t count)
+{
+    const __m128 scale = _mm_set1_ps(S32_SCALE);
+    size_t i = 0;
+    
+    for (; i + 4 <= 2 * count; i += 4) {
+        __m128i samples = _mm_loadu_si128((const __m128i *)(in + i));
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(samples), scale));
+    }
+    
+    convert_scalar(out + i, in + i, (2 * count - i) / 2, S32_SCALE);
+}
+
+__attribute__((target("avx2")))
+static void s16_avx2(float *out, const int16_t *in, size_t count)
+{
+    const __m256 scale = _mm256_set1_ps(S16_SCALE);
+    size_t i = 0;
+    
+    for (; i + 16 <= 2 * count; i += 16) {
+        __m128i low = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i high = _mm_loadu_si128((const __m128i *)(in + i + 8));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(low)), scale));
+        _mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(high)), scale));
+    }
+    
+    convert_scalar(out + i, in + i, (2 * count - i) / 2, S16_SCALE);
+}
+
+__attribute__((target("avx2")))
+static void s32_avx2(float *out, const int32_t *in, size_t count)
+{
+    const __m256 scale = _mm256_set1_ps(S32_SCALE);
+    size_t i = 0;
+    
+    for (; i + 8 <= 2 * count; i += 8) {
+        __m256i samples = _mm256_loadu_si256((const __m256i *)(in + i));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(samples), scale));
+    }
+    
+    convert_scalar(out + i, in + i, (2 * count - i) / 2, S32_SCALE);
+}
+
+static const ConversionKernels sse2_kernels = { "sse2", s16_sse2, s32_sse2 };
+static const ConversionKernels avx2_kernels = { "avx2", s16_avx2, s32_avx2 };
+#endif
+
+/* === Selection === */
+
+static const ConversionKernels *kernels = &scalar_kernels;
+
+const ConversionKernels *sample_conversion_kernels(int index)
+{
+    const ConversionKernels *usable[3];
+    int count = 0;
+    
+    usable[count++] = &scalar_kernels;
+#if defined(HAVE_X86_KERNELS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        usable[count++] = &sse2_kernels;
+    if (__builtin_cpu_supports("avx2"))
+        usable[count++] = &avx2_kernels;
+#elif defined(__aarch64__)
+    if (neon_conversion_kernels())
+        usable[count++] = neon_conversion_kernels();
+#elif defined(__arm__)
+    if ((getauxval(AT_HWCAP) & HWCAP_NEON) && neon_conversion_kernels())
+        usable[count++] = neon_conversion_kernels();
+#endif
+    
+    return index >= 0 && index < count ? usable[index] : NULL;
+}
+
+void init_sample_conversion()
+{
+    for (int i = 0; sample_conversion_kernels(i); i++)
+        kernels = sample_conversion_kernels(i);
+}
+
+const char *sample_conversion_name()
+{
+    return kernels->name;
+}
+
+template <>
+void convert_iq_samples<int16_t>(std::complex<float> *out, const int16_t *in, size_t count)
+{
+    kernels->from_s16(reinterpret_cast<float *>(out), in, count);
+}
+
+template <>
+void convert_iq_samples<int32_t>(std::complex<float> *out, const int32_t *in, size_t count)
+{
+    kernels->from_s32(reinterpret_cast<float *>(out), in, count);
+}
+
+/* Float samples are already in the right layout */
+template <>
+void convert_iq_samples<float>(std::complex<float> *out, const float *in, size_t count)
+{
+    std::memcpy(static_cast<void *>(out), in, count * sizeof(std::complex<float>));
+}
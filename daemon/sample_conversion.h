@@ -0,0 +1,47 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Conversion of interleaved I-Q samples, as found in ALSA's buffers,
+ * to the complex floats librpitx takes. Integer samples are scaled to
+ * [-1, 1[. The fastest implementation for the CPU (NEON, AVX2, SSE2 or
+ * plain C++) is picked once by init_sample_conversion().
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#ifndef SAMPLE_CONVERSION_H
+#define SAMPLE_CONVERSION_H
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+
+/* To be called once at startup, before any conversion. */
+void init_sample_conversion();
+
+/* Name of the implementation in use, for logging. */
+const char *sample_conversion_name();
+
+/* Convert count I-Q pairs (2 * count values) from in to out.
+ * Available for int16_t (S16), int32_t (S32) and float samples. */
+template <typename Sample>
+void convert_iq_samples(std::complex<float> *out, const Sample *in, size_t count);
+
+/* One set of kernels. Each converts 2 * count interleaved values. */
+struct ConversionKernels
+{
+    const char *name;
+    void (*from_s16)(float *out, const int16_t *in, size_t count);
+    void (*from_s32)(float *out, const int32_t *in, size_t count);
+};
+
+/* The index-th set of kernels usable on this CPU, from the plain C++ one
+ * to the one init_sample_conversion() picks, or NULL past the last one.
+ * For the benchmarks. */
+const ConversionKernels *sample_conversion_kernels(int index);
+
+/* NEON kernels, or NULL when the daemon was built without NEON. */
+const ConversionKernels *neon_conversion_kernels();
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * NEON kernels for the I-Q sample conversion.
+ * On 32-bit ARM this file is built with NEON enabled, and the kernels
+ * are only used if the CPU has it.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include "sample_conversion.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+
+static void s16_neon(float *out, const int16_t *in, size_t count)
+{
+    size_t i = 0;
+    
+    /* Fixed point conversions do the scaling for free */
+    for (; i + 8 <= 2 * count; i += 8) {
+        int16x8_t samples = vld1q_s16(in + i);
+        vst1q_f32(out + i, vcvtq_n_f32_s32(vmovl_s16(vget_low_s16(samples)), 15));
+        vst1q_f32(out + i + 4, vcvtq_n_f32_s32(vmovl_s16(vget_high_s16(samples)), 15));
+    }
+    
+    for (; i < 2 * count; i++)
+        out[i] = in[i] / 32768.0f;
+}
+
+static void s32_neon(float *out, const int32_t *in, size_t count)
+{
+    size_t i = 0;
+    
+    for (; i + 4 <= 2 * count; i += 4)
+        vst1q_f32(out + i, vcvtq_n_f32_s32(vld1q_s32(in + i), 31));
+    
+    for (; i < 2 * count; i++)
+        out[i] = in[i] / 2147483648.0f;
+}
+
+static const ConversionKernels neon_kernels = { "neon", s16_neon, s32_neon };
+
+const ConversionKernels *neon_conversion_kernels()
+{
+    return &neon_kernels;
+}
+
+#else
+
+const ConversionKernels *neon_conversion_kernels()
+{
+    return NULL;
+}
+
+#endif
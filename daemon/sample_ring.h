@@ -0,0 +1,86 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * Lock-free ring between the thread reading /dev/rpitxin and the thread
+ * feeding the DMA. One thread writes, the other reads, and neither ever
+ * waits on the other inside the ring. Each side works on contiguous
+ * spans of the ring, so samples are converted and sent in place.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#ifndef SAMPLE_RING_H
+#define SAMPLE_RING_H
+
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+
+#define CACHE_LINE_SIZE 64
+
+/* Capacity is a number of samples, and must be a power of two */
+template<typename T, size_t Capacity>
+class SampleRing
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    
+public:
+    SampleRing() : head(0), tail(0), highWater(0) {}
+    
+    static constexpr size_t capacity() { return Capacity; }
+    
+    /* Writer side: free space at the head, count is set to how much of
+     * it is contiguous. commit() publishes what was written there. */
+    T *write_span(size_t &count)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t offset = h & (Capacity - 1);
+        count = std::min(Capacity - (h - tail.load(std::memory_order_acquire)), Capacity - offset);
+        return data + offset;
+    }
+    
+    void commit(size_t count)
+    {
+        size_t h = head.load(std::memory_order_relaxed) + count;
+        head.store(h, std::memory_order_release);
+        
+        size_t used = h - tail.load(std::memory_order_relaxed);
+        if (used > highWater.load(std::memory_order_relaxed))
+            highWater.store(used, std::memory_order_relaxed);
+    }
+    
+    /* Reader side: samples at the tail, count is set to how many of
+     * them are contiguous. consume() gives them back to the writer. */
+    const T *read_span(size_t &count)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t offset = t & (Capacity - 1);
+        count = std::min(head.load(std::memory_order_acquire) - t, Capacity - offset);
+        return data + offset;
+    }
+    
+    void consume(size_t count)
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+    
+    /* Samples in the ring, from either side */
+    size_t fill() const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+    
+    /* Highest fill ever seen, to size the ring */
+    size_t high_water() const { return highWater.load(std::memory_order_relaxed); }
+    
+private:
+    /* Each index on its own cache line, so the two threads do not fight
+     * over the same line at every update */
+    alignas(CACHE_LINE_SIZE) T data[Capacity];
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> highWater;
+};
+
+#endif
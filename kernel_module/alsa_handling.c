@@ -2,33 +2,88 @@
  * rpitx_alsa module
  * Author: Kevin "felixzero" Guilloy, F4VQG
  * 
- * This file handles the ALSA PCM interface. It declares one device with 2 PCMs:
- *  - number 0 is stereo only and takes I-Q samples
+ * This file handles the ALSA PCM interface. It declares one device with 3 PCMs:
+ *  - number 0 is stereo only and takes I-Q samples, as 16 or 32 bit
+ *    integers or floats
  *  - number 1 is mono only and takes (already pre-filtered) USB samples
+ *  - number 2 is capture only, and gives back as S16 I-Q what the daemon
+ *    takes from the stream picked by the "Monitor Source" control,
+ *    dropping what does not fit
+ * Each of the first two has several substreams, which can play at the
+ * same time.
+ * 
+ * There is no hardware behind the PCMs, so an hrtimer plays the part of
+ * the playback clock: it moves the hardware pointer of every running
+ * substream at the negotiated rate, and copies what it plays into the FIFO
+ * of that substream, which the daemon empties at its own pace. ALSA thus
+ * sees a steady clock, whatever the daemon does. All the substreams share
+ * the rate and the clock, so the daemon can mix them sample by sample.
  * 
  * This file is licensed under GNU GPL v3.
  */
 
 #include <linux/platform_device.h>
+#include <linux/moduleparam.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/timekeeping.h>
 #include <sound/core.h>
+#include <sound/control.h>
 #include <sound/pcm.h>
 #include <sound/initval.h>
 
 #include "alsa_handling.h"
 #include "iq_sample_generation.h"
+#include "sample_fifo.h"
 
 /* Basic configuration */
 #define SND_RPITX_DRIVER "snd_rpitx"
 
-/* Buffer size definition */
-#define NUMBER_OF_PERIODS 8
-#define MAX_BUFFER (PERIOD_BYTES * NUMBER_OF_PERIODS)
+/* Buffer size definition, in bytes of S16 I-Q data. The limits apply to
+ * the number of frames, so 32 bit formats get twice the bytes and the mono
+ * device half of them. The applications pick their geometry within these
+ * bounds. */
+static int min_period_bytes = 64;
+module_param(min_period_bytes, int, 0444);
+MODULE_PARM_DESC(min_period_bytes, "Smallest period allowed, in bytes of I-Q data (default: 64)");
+
+static int max_period_bytes = 4096;
+module_param(max_period_bytes, int, 0444);
+MODULE_PARM_DESC(max_period_bytes, "Largest period allowed, in bytes of I-Q data (default: 4096)");
+
+static int max_periods = 16;
+module_param(max_periods, int, 0444);
+MODULE_PARM_DESC(max_periods, "Largest number of periods in the buffer (default: 16)");
+
+#define MAX_BUFFER (max_period_bytes * max_periods)
+
+/* Largest I-Q frame, in bytes (S32 or FLOAT) */
+#define MAX_FRAME_BYTES 8
+
+/* FIFO between the virtual clock and the daemon, in bytes */
+static int fifo_bytes = 131072;
+module_param(fifo_bytes, int, 0444);
+MODULE_PARM_DESC(fifo_bytes, "Size of the FIFO feeding the daemon, rounded up to a power of two (default: 131072)");
+
+/* Substreams of each PCM, each with its own FIFO */
+static int substreams = 4;
+module_param(substreams, int, 0444);
+MODULE_PARM_DESC(substreams, "Substreams of each PCM, mixed together (default: 4, up to 8)");
+
+/* Shortest interval between two ticks of the virtual clock */
+#define MIN_TICK_NS 500000
 
 /* Device names definition */
 #define SND_DRIVER_NAME "snd_rpitx"
 #define SND_CARD_NAME "rpitx"
 #define STEREO_IQ_DEVICE_NAME "sendiq"
 #define MONO_USB_DEVICE_NAME "usbdata"
+#define MONITOR_DEVICE_NAME "monitor"
 
 /* Arrays needed for ALSA */
 static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;
@@ -37,62 +92,131 @@ static int enable[SNDRV_CARDS] = {1, [1 ... (SNDRV_CARDS - 1)] = 0};
 static struct platform_device *devices[SNDRV_CARDS];
 
 
+/* Applications may write straight into the buffer through mmap(). The
+ * virtual clock reads it at the hardware pointer on each tick, and checks
+ * the application pointer at that time, so nothing has to be done when the
+ * application moves it and no ack callback is needed. */
+#define RPITX_PCM_INFO_MMAP (SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_MMAP_VALID | \
+                             SNDRV_PCM_INFO_BLOCK_TRANSFER)
+
 /* PCM configuration for stereo (I-Q) */
 static struct snd_pcm_hardware rpitx_pcm_stereo_hw =
 {
-    .info = SNDRV_PCM_INFO_INTERLEAVED,
+    .info = SNDRV_PCM_INFO_INTERLEAVED | RPITX_PCM_INFO_MMAP | SNDRV_PCM_INFO_PAUSE |
+            SNDRV_PCM_INFO_DRAIN_TRIGGER,
+    .formats = SNDRV_PCM_FMTBIT_S16_LE | SNDRV_PCM_FMTBIT_S32_LE | SNDRV_PCM_FMTBIT_FLOAT_LE,
+    .rates = SNDRV_PCM_RATE_8000_192000,
+    .rate_min = 8000,
+    .rate_max = 192000,
+    .channels_min = 2,
+    .channels_max = 2,
+    .periods_min = 1,
+    /* Buffer and period sizes are set from the module parameters */
+};
+
+/* PCM configuration for the monitor (I-Q capture). Whatever the format of
+ * the stream it mirrors, the samples are given as S16. */
+static struct snd_pcm_hardware rpitx_pcm_monitor_hw =
+{
+    .info = SNDRV_PCM_INFO_INTERLEAVED | RPITX_PCM_INFO_MMAP | SNDRV_PCM_INFO_PAUSE,
     .formats = SNDRV_PCM_FMTBIT_S16_LE,
-    .rates = SNDRV_PCM_RATE_8000_48000,
+    .rates = SNDRV_PCM_RATE_8000_192000,
     .rate_min = 8000,
-    .rate_max = 48000,
+    .rate_max = 192000,
     .channels_min = 2,
     .channels_max = 2,
-    .buffer_bytes_max = MAX_BUFFER,
-    .period_bytes_min = PERIOD_BYTES,
-    .period_bytes_max = PERIOD_BYTES,
     .periods_min = 1,
-    .periods_max = NUMBER_OF_PERIODS,
+    /* Buffer and period sizes are set from the module parameters */
 };
 
 /* PCM configuration for mono (USB) */
 static struct snd_pcm_hardware rpitx_pcm_mono_hw =
 {
-    .info = SNDRV_PCM_INFO_INTERLEAVED,
+    .info = SNDRV_PCM_INFO_INTERLEAVED | RPITX_PCM_INFO_MMAP | SNDRV_PCM_INFO_PAUSE |
+            SNDRV_PCM_INFO_DRAIN_TRIGGER,
     .formats = SNDRV_PCM_FMTBIT_S16_LE,
     .rates = SNDRV_PCM_RATE_8000_48000,
     .rate_min = 8000,
     .rate_max = 48000,
     .channels_min = 1,
     .channels_max = 1,
-    .buffer_bytes_max = MAX_BUFFER,
-    .period_bytes_min = PERIOD_BYTES / 2,
-    .period_bytes_max = PERIOD_BYTES / 2,
     .periods_min = 1,
-    .periods_max = NUMBER_OF_PERIODS * 2,
+    /* Buffer and period sizes are set from the module parameters */
 };
 
 
-/* Structure definition for "private" date.
- * Those are passed to ALSA and are accessible within callbacks.
- */
-struct rpitx_private_data
+/* One playback substream and its FIFO */
+struct rpitx_stream
 {
-    struct mutex cable_lock;
     struct snd_pcm_substream *substream;
-    int is_stereo;
+    struct rpitx_stream_control *control; /* In the control page */
+    struct sample_fifo fifo;
+    struct iq_generator generator;        /* Mono substreams only */
+    size_t hw_pointer;                    /* In bytes */
+    snd_pcm_uframes_t played;             /* Frames, wrapping as appl_ptr */
+    snd_pcm_uframes_t period_position;
+    ktime_t period_time;
+    unsigned int rate;                    /* 0 until hw_params */
+    int running;
+    atomic64_t stats[RPITX_STAT_COUNT];   /* Each one has a single writer */
 };
 
 struct rpitx_device
 {
-    struct rpitx_private_data stereo_iq_private_data;
-    struct rpitx_private_data mono_usb_private_data;
-    int is_stereo_iq_open;
-    int is_mono_usb_open;
+    struct rpitx_stream streams[RPITX_MAX_STREAMS];
+    int open_streams;
+};
+
+/* Virtual playback clock, ticking while any substream runs */
+struct rpitx_virtual_clock
+{
+    struct hrtimer timer;
+    spinlock_t lock;
+    ktime_t tick;
+    ktime_t base_time;
+    u64 frames_since_base;
+    int running; /* Substreams running */
+    int armed;   /* Timer queued, or its callback not done deciding */
+};
+
+/* The capture substream, filled as the daemon takes the samples of the
+ * source stream. Its pointers are only moved with the lock held. */
+struct rpitx_monitor
+{
+    struct snd_pcm_substream *substream;
+    spinlock_t lock;
+    snd_pcm_uframes_t hw_ptr;     /* Up to the boundary, as ALSA's */
+    snd_pcm_uframes_t period_position;
+    unsigned int source;          /* Index of the stream mirrored */
+    int running;
 };
 
 /* Global state variables */
 struct rpitx_device *mydev;
-size_t buffer_hw_pointer = 0;
+DECLARE_WAIT_QUEUE_HEAD(rpitx_read_wait);
+static struct rpitx_virtual_clock vclock;
+static struct rpitx_monitor monitor;
+static int stream_count;
+
+/* Control page followed by the FIFOs, shared with the daemon through
+ * mmap(), see rpitx_ioctl.h */
+static void *shared_area;
+static struct rpitx_ring_control *ring_control;
+
+/* Serializes the readers of the FIFOs, and resets against them */
+static DEFINE_MUTEX(fifo_lock);
+
+/* Serializes the opening and configuration of the substreams */
+static DEFINE_MUTEX(streams_lock);
+
+/* Frames in the daemon and DMA FIFOs, reported by the daemon */
+static unsigned int downstream_frames;
+
+/* Negotiated parameters, published to the daemon */
+static unsigned int stream_rate;
+static atomic_t params_generation = ATOMIC_INIT(0);
+
+static void reset_fifo(struct rpitx_stream *stream, unsigned int mode, unsigned int format);
 
 /* Free callback, unused */
 static int rpitx_pcm_dev_free(struct snd_device *device)
@@ -108,91 +232,398 @@ static struct snd_device_ops dev_ops =
 
 /* === Common callback functions === */
 
+/* Substreams are numbered from those of sendiq, then those of usbdata */
+static struct rpitx_stream *stream_of(struct snd_pcm_substream *ss)
+{
+    return &mydev->streams[ss->pcm->device * substreams + ss->number];
+}
+
+/* Rate of the substreams that have one, or 0. Called with streams_lock held. */
+static void update_stream_rate(void)
+{
+    unsigned int rate = 0;
+    int i;
+
+    for (i = 0; i < stream_count && !rate; i++)
+        rate = mydev->streams[i].rate;
+
+    /* Let the daemon know it has to follow the new rate */
+    if (rate != stream_rate) {
+        stream_rate = rate;
+        atomic_inc(&params_generation);
+        wake_up_interruptible(&rpitx_read_wait);
+    }
+}
+
+/* Format of the FIFO for an ALSA format, the only ones the PCMs accept */
+static unsigned int fifo_format(snd_pcm_format_t format)
+{
+    switch (format) {
+    case SNDRV_PCM_FORMAT_S32_LE:
+        return RPITX_FORMAT_S32_LE;
+    case SNDRV_PCM_FORMAT_FLOAT_LE:
+        return RPITX_FORMAT_FLOAT_LE;
+    default:
+        return RPITX_FORMAT_S16_LE;
+    }
+}
+
+/* Wait until a tick in progress is done with the substreams it saw running */
+static void sync_clock(void)
+{
+    while (hrtimer_callback_running(&vclock.timer))
+        cpu_relax();
+}
+
 /* Allocation callbacks */
 static int rpitx_hw_params(struct snd_pcm_substream *ss, struct snd_pcm_hw_params *hw_params)
 {
+    struct rpitx_stream *stream = stream_of(ss);
+    int err;
+
+    mutex_lock(&streams_lock);
+
+    /* The substreams are mixed, so they must all have the same rate */
+    stream->rate = 0;
+    update_stream_rate();
+    if (stream_rate && stream_rate != params_rate(hw_params)) {
+        err = -EBUSY;
+        goto out;
+    }
+
     /* We let ALSA handle allocation. */
-    return snd_pcm_lib_malloc_pages(ss, params_buffer_bytes(hw_params));
+    err = snd_pcm_lib_malloc_pages(ss, params_buffer_bytes(hw_params));
+    if (err < 0)
+        goto out;
+
+    /* Samples of the previous format cannot stay in the FIFO */
+    if (stream->control->format != fifo_format(params_format(hw_params)))
+        reset_fifo(stream, stream->control->mode, fifo_format(params_format(hw_params)));
+
+    stream->rate = params_rate(hw_params);
+    update_stream_rate();
+
+out:
+    mutex_unlock(&streams_lock);
+    return err;
 }
 
 static int rpitx_hw_free(struct snd_pcm_substream *ss)
 {
+    sync_clock();
+
+    mutex_lock(&streams_lock);
+    stream_of(ss)->rate = 0;
+    update_stream_rate();
+    mutex_unlock(&streams_lock);
+
     return snd_pcm_lib_free_pages(ss);
 }
 
-/* Device close callback */
+/* Device close callback. What is left in the FIFO still goes on the air. */
 static int rpitx_pcm_close(struct snd_pcm_substream *ss)
 {
-    mydev->is_mono_usb_open = 0;
-    mydev->is_stereo_iq_open = 0;
+    sync_clock();
+
+    mutex_lock(&streams_lock);
+    mydev->open_streams--;
+    atomic_inc(&params_generation);
+    mutex_unlock(&streams_lock);
+
+    wake_up_interruptible(&rpitx_read_wait);
     return 0;
 }
 
-/* Prepare callback, unused */
+/* Counters of the streams. The clock and the readers of the FIFO each
+ * update their own ones, so atomic64 only guards against torn reads. */
+static inline void stat_add(struct rpitx_stream *stream, enum rpitx_stat stat, s64 value)
+{
+    atomic64_add(value, &stream->stats[stat]);
+}
+
+static inline void stat_max(struct rpitx_stream *stream, enum rpitx_stat stat, s64 value)
+{
+    if (value > atomic64_read(&stream->stats[stat]))
+        atomic64_set(&stream->stats[stat], value);
+}
+
+/* Publish a new state of the substream to the daemon */
+static void set_stream_state(struct rpitx_stream *stream, unsigned int state)
+{
+    if (stream->control->state == state)
+        return;
+
+    stream->control->state = state;
+    atomic_inc(&params_generation);
+    wake_up_interruptible(&rpitx_read_wait);
+}
+
+/* Prepare callback, restarts the substream at the beginning of the buffer */
 static int rpitx_pcm_prepare(struct snd_pcm_substream *ss)
 {
+    struct snd_pcm_runtime *runtime = ss->runtime;
+    struct rpitx_stream *stream = stream_of(ss);
+    u64 period_ns = div_u64((u64)runtime->period_size * NSEC_PER_SEC, runtime->rate);
+
+    stream->hw_pointer = 0;
+    stream->played = 0;
+    stream->period_position = 0;
+    stream->period_time = ns_to_ktime(max_t(u64, period_ns, MIN_TICK_NS));
+    set_stream_state(stream, RPITX_STATE_STOPPED);
     return 0;
 }
 
-/* Trigger callback, unused */
+/* Trigger callback, adds the substream to the virtual clock or removes it,
+ * and tells the daemon right away. A draining substream keeps playing until
+ * ALSA stops it, once its buffer is empty.
+ * The clock ticks as often as the shortest period of its substreams.
+ * We are called with the stream lock held, which the timer callback may
+ * be waiting for, so stopping cannot wait for the callback to finish. */
 static int rpitx_pcm_trigger(struct snd_pcm_substream *ss, int cmd)
 {
-    return 0;
+    struct rpitx_stream *stream = stream_of(ss);
+    unsigned long flags;
+    int ret = 0;
+
+    spin_lock_irqsave(&vclock.lock, flags);
+
+    switch (cmd) {
+    case SNDRV_PCM_TRIGGER_START:
+    case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+    case SNDRV_PCM_TRIGGER_RESUME:
+        set_stream_state(stream, RPITX_STATE_RUNNING);
+        if (stream->running)
+            break;
+        stream->running = 1;
+
+        if (vclock.running++ == 0) {
+            vclock.tick = stream->period_time;
+            vclock.base_time = ktime_get();
+            vclock.frames_since_base = 0;
+            /* A callback that could not be cancelled restarts the timer
+             * itself, as it finds the clock running again */
+            if (!vclock.armed) {
+                vclock.armed = 1;
+                hrtimer_start(&vclock.timer, vclock.tick, HRTIMER_MODE_REL);
+            }
+        } else if (ktime_before(stream->period_time, vclock.tick)) {
+            vclock.tick = stream->period_time;
+        }
+        break;
+    case SNDRV_PCM_TRIGGER_DRAIN:
+        if (stream->running)
+            set_stream_state(stream, RPITX_STATE_DRAINING);
+        break;
+    case SNDRV_PCM_TRIGGER_STOP:
+    case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+    case SNDRV_PCM_TRIGGER_SUSPEND:
+        set_stream_state(stream, cmd == SNDRV_PCM_TRIGGER_PAUSE_PUSH ?
+                                 RPITX_STATE_PAUSED : RPITX_STATE_STOPPED);
+        if (!stream->running)
+            break;
+        stream->running = 0;
+
+        /* The callback may be running, waiting for our lock: it stops
+         * the timer itself then */
+        if (--vclock.running == 0 && hrtimer_try_to_cancel(&vclock.timer) >= 0)
+            vclock.armed = 0;
+        break;
+    default:
+        ret = -EINVAL;
+    }
+
+    spin_unlock_irqrestore(&vclock.lock, flags);
+    return ret;
 }
 
-/* Pointer callback returns the size of the used buffer */
+/* Pointer callback returns the position of the virtual clock in the buffer */
 static snd_pcm_uframes_t rpitx_pcm_pointer(struct snd_pcm_substream *ss)
 {
     struct snd_pcm_runtime *runtime = ss->runtime;
-    return bytes_to_frames(runtime, buffer_hw_pointer);
+    struct rpitx_stream *stream = stream_of(ss);
+
+    /* Frames played by the clock but not on the air yet */
+    runtime->delay = bytes_to_frames(runtime, sample_fifo_fill(&stream->fifo)) + downstream_frames;
+
+    return bytes_to_frames(runtime, stream->hw_pointer);
 }
 
+/* Copy frames found at the hardware pointer into the FIFO, followed by
+ * silent frames. What does not fit is dropped, the daemon being too late
+ * for it anyway. */
+static void copy_to_fifo(struct rpitx_stream *stream, struct snd_pcm_runtime *runtime,
+                         snd_pcm_uframes_t frames, snd_pcm_uframes_t silence)
+{
+    u32 bytes = frames_to_bytes(runtime, frames);
+    u32 silent_bytes = frames_to_bytes(runtime, silence);
+    u32 first_part = min_t(u32, bytes, runtime->dma_bytes - stream->hw_pointer);
+    u32 written;
+
+    written = sample_fifo_write(&stream->fifo, runtime->dma_area + stream->hw_pointer, first_part);
+    if (written == first_part)
+        written += sample_fifo_write(&stream->fifo, runtime->dma_area, bytes - first_part);
+    if (written == bytes)
+        written += sample_fifo_write_silence(&stream->fifo, silent_bytes);
+
+    stat_add(stream, RPITX_STAT_BYTES_PLAYED, min(written, bytes));
+    stat_max(stream, RPITX_STAT_MAX_FILL, sample_fifo_fill(&stream->fifo));
+
+    if (written < bytes + silent_bytes) {
+        stat_add(stream, RPITX_STAT_DROPPED_FRAMES, bytes_to_frames(runtime, bytes + silent_bytes - written));
+        pr_warn_ratelimited("rpitx: FIFO full, %u frames dropped\n",
+                            (unsigned int)bytes_to_frames(runtime, bytes + silent_bytes - written));
+    }
 
-/* === Differentiated callback functions === */
+    stream->control->produced = stream->fifo.head;
+}
 
-/* Device open callbacks */
-static int rpitx_pcm_open_stereo(struct snd_pcm_substream *ss)
+/* Frames written by the application and not played yet. The hw_ptr of
+ * ALSA only moves on snd_pcm_period_elapsed(), so it lags behind the
+ * clock within a period: the position played is ours. After an underrun
+ * the clock is ahead of appl_ptr, and nothing is ready. */
+static snd_pcm_uframes_t frames_ready(struct rpitx_stream *stream, struct snd_pcm_runtime *runtime)
 {
-    struct rpitx_private_data *pdata = ss->private_data;
+    snd_pcm_sframes_t ready = READ_ONCE(runtime->control->appl_ptr) - stream->played;
 
-    if (mydev->is_stereo_iq_open || mydev->is_mono_usb_open)
-        return -1;
-    
-    mutex_lock(&pdata->cable_lock);
-    
-    ss->runtime->hw = rpitx_pcm_stereo_hw;
+    if (ready < 0)
+        ready += runtime->boundary;
+    return (snd_pcm_uframes_t)ready > runtime->buffer_size ? 0 : ready;
+}
 
-    pdata->substream = ss;
-    ss->runtime->private_data = pdata;
+/* Play delta frames of one substream */
+static void play_stream(struct rpitx_stream *stream, snd_pcm_uframes_t delta)
+{
+    struct snd_pcm_substream *ss = stream->substream;
+    struct snd_pcm_runtime *runtime = ss->runtime;
+    snd_pcm_uframes_t ready;
+
+    /* On underrun the clock keeps going and plays silence, so the FIFOs
+     * of all running substreams stay in step. ALSA will notice. */
+    ready = min_t(snd_pcm_uframes_t, delta, frames_ready(stream, runtime));
+    copy_to_fifo(stream, runtime, ready, delta - ready);
+    if (ready < delta)
+        stat_add(stream, RPITX_STAT_UNDERRUNS, 1);
+
+    stream->hw_pointer = (stream->hw_pointer + frames_to_bytes(runtime, delta)) % runtime->dma_bytes;
+    stream->played = (stream->played + delta) % runtime->boundary;
+    stream->period_position += delta;
+    if (stream->period_position >= runtime->period_size) {
+        stream->period_position %= runtime->period_size;
+        stat_add(stream, RPITX_STAT_PERIODS, 1);
+        snd_pcm_period_elapsed(ss);
+    }
+}
 
-    mutex_unlock(&pdata->cable_lock);
-    
-    mydev->is_stereo_iq_open = 1;
-    return 0;
+/* Whether the timer goes on, decided under the lock of the trigger
+ * callback, so that a start never races with a restart */
+static enum hrtimer_restart clock_tick_end(struct hrtimer *timer)
+{
+    enum hrtimer_restart ret = HRTIMER_RESTART;
+
+    spin_lock(&vclock.lock);
+    if (vclock.running) {
+        hrtimer_forward_now(timer, vclock.tick);
+    } else {
+        vclock.armed = 0;
+        ret = HRTIMER_NORESTART;
+    }
+    spin_unlock(&vclock.lock);
+
+    return ret;
 }
 
-static int rpitx_pcm_open_mono(struct snd_pcm_substream *ss)
+/* Timer callback, plays the frames due since the last tick */
+static enum hrtimer_restart rpitx_clock_tick(struct hrtimer *timer)
 {
-    struct rpitx_private_data *pdata = ss->private_data;
+    snd_pcm_uframes_t delta;
+    u64 elapsed_ns, frames;
+    int i;
 
-    if (mydev->is_stereo_iq_open || mydev->is_mono_usb_open)
-        return -1;
+    if (!READ_ONCE(vclock.running))
+        return clock_tick_end(timer);
+
+    /* Frames are counted from a base time, so the rounding never drifts.
+     * A start may set a new base while the callback runs. */
+    spin_lock(&vclock.lock);
+    elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), vclock.base_time));
+    frames = div_u64(elapsed_ns * stream_rate, NSEC_PER_SEC);
+    delta = frames - vclock.frames_since_base;
+    vclock.frames_since_base = frames;
+
+    /* Move the base every second, so the product above never overflows */
+    if (elapsed_ns >= NSEC_PER_SEC) {
+        vclock.base_time = ktime_add_ns(vclock.base_time, NSEC_PER_SEC);
+        vclock.frames_since_base -= stream_rate;
+    }
+    spin_unlock(&vclock.lock);
 
-    mutex_lock(&pdata->cable_lock);
+    for (i = 0; i < stream_count; i++)
+        if (READ_ONCE(mydev->streams[i].running))
+            play_stream(&mydev->streams[i], delta);
 
-    ss->runtime->hw = rpitx_pcm_mono_hw;
+    if (delta)
+        wake_up_interruptible(&rpitx_read_wait);
 
-    pdata->substream = ss;
-    ss->runtime->private_data = pdata;
+    /* The substreams may have been stopped from snd_pcm_period_elapsed() */
+    return clock_tick_end(timer);
+}
 
-    mutex_unlock(&pdata->cable_lock);
 
-    clear_iq_sample_generation();
-    
-    mydev->is_mono_usb_open = 1;
+/* === Differentiated callback functions === */
+
+/* Common part of the open callbacks */
+static int rpitx_pcm_open(struct snd_pcm_substream *ss, const struct snd_pcm_hardware *hw,
+                          unsigned int mode)
+{
+    struct rpitx_stream *stream = stream_of(ss);
+    int err;
+
+    ss->runtime->hw = *hw;
+    snd_pcm_hw_constraint_integer(ss->runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+
+    /* The geometry is the same number of frames whatever the format */
+    err = snd_pcm_hw_constraint_minmax(ss->runtime, SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+                                       min_period_bytes / 4, max_period_bytes / 4);
+    if (err < 0)
+        return err;
+    err = snd_pcm_hw_constraint_minmax(ss->runtime, SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+                                       min_period_bytes / 4, MAX_BUFFER / 4);
+    if (err < 0)
+        return err;
+
+    mutex_lock(&streams_lock);
+
+    /* Later substreams follow the rate of the first ones */
+    if (stream_rate) {
+        err = snd_pcm_hw_constraint_minmax(ss->runtime, SNDRV_PCM_HW_PARAM_RATE,
+                                           stream_rate, stream_rate);
+        if (err < 0) {
+            mutex_unlock(&streams_lock);
+            return err;
+        }
+    }
+
+    mydev->open_streams++;
+    atomic_inc(&params_generation);
+    mutex_unlock(&streams_lock);
+
+    stream->substream = ss;
+    reset_fifo(stream, mode, RPITX_FORMAT_S16_LE);
+    wake_up_interruptible(&rpitx_read_wait);
     return 0;
 }
 
+/* Device open callbacks */
+static int rpitx_pcm_open_stereo(struct snd_pcm_substream *ss)
+{
+    return rpitx_pcm_open(ss, &rpitx_pcm_stereo_hw, RPITX_RING_IQ);
+}
+
+static int rpitx_pcm_open_mono(struct snd_pcm_substream *ss)
+{
+    return rpitx_pcm_open(ss, &rpitx_pcm_mono_hw, RPITX_RING_USB);
+}
+
 static struct snd_pcm_ops rpitx_pcm_ops_stereo =
 {
     .open = rpitx_pcm_open_stereo, /* Only difference */
@@ -217,6 +648,332 @@ static struct snd_pcm_ops rpitx_pcm_ops_mono =
     .pointer = rpitx_pcm_pointer,
 };
 
+
+/* === Monitor === */
+
+/* A stream sample as S16. Floats are scaled without the FPU: the value is
+ * the 24 bit mantissa times 2^(exponent - 150), and S16 is 2^15 times it. */
+static s16 monitor_sample(const char *data, unsigned int format)
+{
+    u32 bits, mantissa;
+    int shift;
+
+    switch (format) {
+    case RPITX_FORMAT_S32_LE:
+        return *(const s32 *)data >> 16;
+    case RPITX_FORMAT_FLOAT_LE:
+        bits = *(const u32 *)data;
+        if (!(bits & 0x7f800000))
+            return 0; /* Zero or denormal */
+        mantissa = (bits & 0x7fffff) | 0x800000;
+        shift = (int)((bits >> 23) & 0xff) - 150 + 15;
+        if (shift >= 0)
+            mantissa = S16_MAX + 1;
+        else if (shift > -24)
+            mantissa = min_t(u32, mantissa >> -shift, S16_MAX + 1);
+        else
+            mantissa = 0;
+        return bits & 0x80000000 ? -(s32)mantissa : (s32)min_t(u32, mantissa, S16_MAX);
+    default:
+        return *(const s16 *)data;
+    }
+}
+
+/* Whether what the daemon takes from stream must be mirrored */
+static int monitored(struct rpitx_stream *stream)
+{
+    return READ_ONCE(monitor.running) && stream == &mydev->streams[READ_ONCE(monitor.source)];
+}
+
+/* Append I-Q of the given format to the capture buffer, with fifo_lock
+ * held. What does not fit is dropped: the daemon is never held back.
+ * This goes at most one period at a time, so that ALSA sees each of
+ * them go by, even when the daemon takes a whole buffer at once. */
+static void monitor_write(const char *data, u32 bytes, unsigned int format)
+{
+    struct snd_pcm_substream *ss;
+    struct snd_pcm_runtime *runtime;
+    u32 sample_bytes = format == RPITX_FORMAT_S16_LE ? 2 : 4;
+    snd_pcm_uframes_t frames = bytes / (2 * sample_bytes);
+    snd_pcm_uframes_t used, room, part, i;
+    unsigned long flags;
+    int elapsed;
+    s16 *out;
+
+    while (frames) {
+        spin_lock_irqsave(&monitor.lock, flags);
+
+        ss = monitor.substream;
+        if (!monitor.running || !ss) {
+            spin_unlock_irqrestore(&monitor.lock, flags);
+            return;
+        }
+        runtime = ss->runtime;
+
+        /* Room left before the application pointer */
+        used = monitor.hw_ptr - runtime->control->appl_ptr;
+        if ((snd_pcm_sframes_t)used < 0)
+            used += runtime->boundary;
+        room = runtime->buffer_size - min(used, runtime->buffer_size);
+        if (frames > room) {
+            pr_warn_ratelimited("rpitx: monitor full, %u frames dropped\n",
+                                (unsigned int)(frames - room));
+            frames = room;
+        }
+        part = min(frames, runtime->period_size - monitor.period_position);
+
+        for (i = 0; i < part; i++) {
+            out = (s16 *)(runtime->dma_area + frames_to_bytes(runtime, (monitor.hw_ptr + i) % runtime->buffer_size));
+            out[0] = monitor_sample(data, format);
+            out[1] = monitor_sample(data + sample_bytes, format);
+            data += 2 * sample_bytes;
+        }
+        frames -= part;
+
+        monitor.hw_ptr = (monitor.hw_ptr + part) % runtime->boundary;
+        monitor.period_position += part;
+        elapsed = monitor.period_position >= runtime->period_size;
+        if (elapsed)
+            monitor.period_position = 0;
+
+        spin_unlock_irqrestore(&monitor.lock, flags);
+
+        /* ALSA may stop the substream from there, which takes the lock */
+        if (elapsed)
+            snd_pcm_period_elapsed(ss);
+    }
+}
+
+void rpitx_alsa_monitor_iq(const int16_t *iq, size_t frames)
+{
+    monitor_write((const char *)iq, frames * 4, RPITX_FORMAT_S16_LE);
+}
+
+static int rpitx_monitor_open(struct snd_pcm_substream *ss)
+{
+    int err;
+
+    ss->runtime->hw = rpitx_pcm_monitor_hw;
+    snd_pcm_hw_constraint_integer(ss->runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+
+    /* As the stream it mirrors, the monitor has the rate of the card */
+    mutex_lock(&streams_lock);
+    err = stream_rate ? snd_pcm_hw_constraint_minmax(ss->runtime, SNDRV_PCM_HW_PARAM_RATE,
+                                                     stream_rate, stream_rate) : 0;
+    mutex_unlock(&streams_lock);
+    if (err < 0)
+        return err;
+
+    spin_lock_irq(&monitor.lock);
+    monitor.substream = ss;
+    spin_unlock_irq(&monitor.lock);
+    return 0;
+}
+
+/* Waits for a write in progress, period elapsed included */
+static int rpitx_monitor_close(struct snd_pcm_substream *ss)
+{
+    mutex_lock(&fifo_lock);
+    spin_lock_irq(&monitor.lock);
+    monitor.substream = NULL;
+    spin_unlock_irq(&monitor.lock);
+    mutex_unlock(&fifo_lock);
+    return 0;
+}
+
+static int rpitx_monitor_hw_params(struct snd_pcm_substream *ss, struct snd_pcm_hw_params *hw_params)
+{
+    return snd_pcm_lib_malloc_pages(ss, params_buffer_bytes(hw_params));
+}
+
+static int rpitx_monitor_hw_free(struct snd_pcm_substream *ss)
+{
+    return snd_pcm_lib_free_pages(ss);
+}
+
+static int rpitx_monitor_prepare(struct snd_pcm_substream *ss)
+{
+    spin_lock_irq(&monitor.lock);
+    monitor.hw_ptr = 0;
+    monitor.period_position = 0;
+    spin_unlock_irq(&monitor.lock);
+    return 0;
+}
+
+static int rpitx_monitor_trigger(struct snd_pcm_substream *ss, int cmd)
+{
+    unsigned long flags;
+    int ret = 0;
+
+    spin_lock_irqsave(&monitor.lock, flags);
+
+    switch (cmd) {
+    case SNDRV_PCM_TRIGGER_START:
+    case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+    case SNDRV_PCM_TRIGGER_RESUME:
+        WRITE_ONCE(monitor.running, 1);
+        break;
+    case SNDRV_PCM_TRIGGER_STOP:
+    case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+    case SNDRV_PCM_TRIGGER_SUSPEND:
+        WRITE_ONCE(monitor.running, 0);
+        break;
+    default:
+        ret = -EINVAL;
+    }
+
+    spin_unlock_irqrestore(&monitor.lock, flags);
+    return ret;
+}
+
+static snd_pcm_uframes_t rpitx_monitor_pointer(struct snd_pcm_substream *ss)
+{
+    return monitor.hw_ptr % ss->runtime->buffer_size;
+}
+
+static struct snd_pcm_ops rpitx_pcm_ops_monitor =
+{
+    .open = rpitx_monitor_open,
+    .close = rpitx_monitor_close,
+    .ioctl = snd_pcm_lib_ioctl,
+    .hw_params = rpitx_monitor_hw_params,
+    .hw_free = rpitx_monitor_hw_free,
+    .prepare = rpitx_monitor_prepare,
+    .trigger = rpitx_monitor_trigger,
+    .pointer = rpitx_monitor_pointer,
+};
+
+
+/* === Mixer controls === */
+
+/* Each PCM has one element per substream, the index being the subdevice.
+ * The values live in the control page, where the daemon reads them. */
+static struct rpitx_stream_control *control_of(struct snd_kcontrol *kcontrol,
+                                               struct snd_ctl_elem_id *id)
+{
+    return mydev->streams[kcontrol->private_value * substreams
+                          + snd_ctl_get_ioffidx(kcontrol, id)].control;
+}
+
+static int rpitx_offset_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+    uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+    uinfo->count = 1;
+    uinfo->value.integer.min = -(int)rpitx_pcm_stereo_hw.rate_max / 2;
+    uinfo->value.integer.max = rpitx_pcm_stereo_hw.rate_max / 2;
+    return 0;
+}
+
+static int rpitx_offset_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+    ucontrol->value.integer.value[0] = control_of(kcontrol, &ucontrol->id)->offset;
+    return 0;
+}
+
+static int rpitx_offset_put(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+    struct rpitx_stream_control *control = control_of(kcontrol, &ucontrol->id);
+    int offset = clamp_t(long, ucontrol->value.integer.value[0],
+                         -(int)rpitx_pcm_stereo_hw.rate_max / 2, rpitx_pcm_stereo_hw.rate_max / 2);
+
+    if (control->offset == offset)
+        return 0;
+    control->offset = offset;
+    return 1;
+}
+
+static int rpitx_gain_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+    uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+    uinfo->count = 1;
+    uinfo->value.integer.min = 0;
+    uinfo->value.integer.max = 100;
+    return 0;
+}
+
+static int rpitx_gain_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+    ucontrol->value.integer.value[0] = control_of(kcontrol, &ucontrol->id)->gain;
+    return 0;
+}
+
+static int rpitx_gain_put(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+    struct rpitx_stream_control *control = control_of(kcontrol, &ucontrol->id);
+    unsigned int gain = clamp_t(long, ucontrol->value.integer.value[0], 0, 100);
+
+    if (control->gain == gain)
+        return 0;
+    control->gain = gain;
+    return 1;
+}
+
+static const struct snd_kcontrol_new rpitx_offset_control =
+{
+    .iface = SNDRV_CTL_ELEM_IFACE_PCM,
+    .name = "Frequency Offset",
+    .info = rpitx_offset_info,
+    .get = rpitx_offset_get,
+    .put = rpitx_offset_put,
+};
+
+static const struct snd_kcontrol_new rpitx_gain_control =
+{
+    .iface = SNDRV_CTL_ELEM_IFACE_PCM,
+    .name = "Playback Volume",
+    .info = rpitx_gain_info,
+    .get = rpitx_gain_get,
+    .put = rpitx_gain_put,
+};
+
+/* The stream mirrored by the monitor, numbered as in the stats */
+static int rpitx_source_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+    uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+    uinfo->count = 1;
+    uinfo->value.integer.min = 0;
+    uinfo->value.integer.max = stream_count - 1;
+    return 0;
+}
+
+static int rpitx_source_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+    ucontrol->value.integer.value[0] = READ_ONCE(monitor.source);
+    return 0;
+}
+
+static int rpitx_source_put(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+    unsigned int source = clamp_t(long, ucontrol->value.integer.value[0], 0, stream_count - 1);
+
+    if (monitor.source == source)
+        return 0;
+    WRITE_ONCE(monitor.source, source);
+    return 1;
+}
+
+static const struct snd_kcontrol_new rpitx_source_control =
+{
+    .iface = SNDRV_CTL_ELEM_IFACE_PCM,
+    .device = 2,
+    .name = "Monitor Source",
+    .info = rpitx_source_info,
+    .get = rpitx_source_get,
+    .put = rpitx_source_put,
+};
+
+/* Add one control of the given PCM device, with an element per substream */
+static int add_stream_control(struct snd_card *card, const struct snd_kcontrol_new *template, int device)
+{
+    struct snd_kcontrol_new control = *template;
+
+    control.device = device;
+    control.count = substreams;
+    control.private_value = device;
+
+    return snd_ctl_add(card, snd_ctl_new1(&control, mydev));
+}
+
 /* Probe callback */
 static int rpitx_probe(struct platform_device *devptr)
 {
@@ -224,9 +981,10 @@ static int rpitx_probe(struct platform_device *devptr)
     struct snd_card *card;
     int ret;
 
-    struct snd_pcm *stereo_pcm, *mono_pcm;
+    struct snd_pcm *stereo_pcm, *mono_pcm, *monitor_pcm;
 
     int dev = devptr->id;
+    int i;
 
     ret = snd_card_new(&devptr->dev, index[dev], id[dev], THIS_MODULE, sizeof(struct rpitx_device), &card);
 
@@ -235,12 +993,14 @@ static int rpitx_probe(struct platform_device *devptr)
 
     mydev = card->private_data;
     
-    mydev->is_stereo_iq_open = 0;
-    mydev->is_mono_usb_open = 0;
-    mydev->stereo_iq_private_data.is_stereo = 1;
-    mydev->mono_usb_private_data.is_stereo = 0;
-    mutex_init(&mydev->stereo_iq_private_data.cable_lock);
-    mutex_init(&mydev->mono_usb_private_data.cable_lock);
+    mydev->open_streams = 0;
+    for (i = 0; i < stream_count; i++) {
+        mydev->streams[i].control = &ring_control->stream[i];
+        mydev->streams[i].control->gain = 100;
+        sample_fifo_init(&mydev->streams[i].fifo,
+                         (char *)shared_area + PAGE_SIZE * RPITX_MMAP_RING_PGOFF + i * fifo_bytes,
+                         fifo_bytes);
+    }
     
     sprintf(card->driver, SND_DRIVER_NAME);
     sprintf(card->shortname, SND_CARD_NAME);
@@ -253,33 +1013,61 @@ static int rpitx_probe(struct platform_device *devptr)
         goto __nodev;
 
     /* Stereo (I/Q data) playback device */
-    ret = snd_pcm_new(card, STEREO_IQ_DEVICE_NAME, 0, 1, 0, &stereo_pcm);
+    ret = snd_pcm_new(card, STEREO_IQ_DEVICE_NAME, 0, substreams, 0, &stereo_pcm);
     if (ret < 0)
         goto __nodev;
 
     snd_pcm_set_ops(stereo_pcm, SNDRV_PCM_STREAM_PLAYBACK, &rpitx_pcm_ops_stereo);
-    stereo_pcm->private_data = &mydev->stereo_iq_private_data;
+    stereo_pcm->private_data = mydev;
     stereo_pcm->info_flags = 0;
     strcpy(stereo_pcm->name, STEREO_IQ_DEVICE_NAME);
 
-    ret = snd_pcm_lib_preallocate_pages_for_all(stereo_pcm, SNDRV_DMA_TYPE_CONTINUOUS, snd_dma_continuous_data(GFP_KERNEL), MAX_BUFFER, MAX_BUFFER);
+    ret = snd_pcm_lib_preallocate_pages_for_all(stereo_pcm, SNDRV_DMA_TYPE_CONTINUOUS, snd_dma_continuous_data(GFP_KERNEL), MAX_BUFFER * 2, MAX_BUFFER * 2);
     if (ret < 0)
         goto __nodev;
 
     /* Mono (USB data) playback device */
-    ret = snd_pcm_new(card, MONO_USB_DEVICE_NAME, 1, 1, 0, &mono_pcm);
+    ret = snd_pcm_new(card, MONO_USB_DEVICE_NAME, 1, substreams, 0, &mono_pcm);
     if (ret < 0)
         goto __nodev;
 
     snd_pcm_set_ops(mono_pcm, SNDRV_PCM_STREAM_PLAYBACK, &rpitx_pcm_ops_mono);
-    mono_pcm->private_data = &mydev->mono_usb_private_data;
+    mono_pcm->private_data = mydev;
     mono_pcm->info_flags = 0;
     strcpy(mono_pcm->name, MONO_USB_DEVICE_NAME);
 
-    ret = snd_pcm_lib_preallocate_pages_for_all(mono_pcm, SNDRV_DMA_TYPE_CONTINUOUS, snd_dma_continuous_data(GFP_KERNEL), MAX_BUFFER, MAX_BUFFER);
+    ret = snd_pcm_lib_preallocate_pages_for_all(mono_pcm, SNDRV_DMA_TYPE_CONTINUOUS, snd_dma_continuous_data(GFP_KERNEL), MAX_BUFFER / 2, MAX_BUFFER / 2);
+    if (ret < 0)
+        goto __nodev;
+
+    /* Capture of what the daemon takes */
+    ret = snd_pcm_new(card, MONITOR_DEVICE_NAME, 2, 0, 1, &monitor_pcm);
+    if (ret < 0)
+        goto __nodev;
+
+    snd_pcm_set_ops(monitor_pcm, SNDRV_PCM_STREAM_CAPTURE, &rpitx_pcm_ops_monitor);
+    monitor_pcm->private_data = mydev;
+    monitor_pcm->info_flags = 0;
+    strcpy(monitor_pcm->name, MONITOR_DEVICE_NAME);
+
+    ret = snd_pcm_lib_preallocate_pages_for_all(monitor_pcm, SNDRV_DMA_TYPE_CONTINUOUS, snd_dma_continuous_data(GFP_KERNEL), MAX_BUFFER, MAX_BUFFER);
     if (ret < 0)
         goto __nodev;
 
+    ret = snd_ctl_add(card, snd_ctl_new1(&rpitx_source_control, mydev));
+    if (ret < 0)
+        goto __nodev;
+
+    /* Per substream frequency offset and gain, applied by the daemon */
+    for (i = 0; i < 2; i++) {
+        ret = add_stream_control(card, &rpitx_offset_control, i);
+        if (ret < 0)
+            goto __nodev;
+        ret = add_stream_control(card, &rpitx_gain_control, i);
+        if (ret < 0)
+            goto __nodev;
+    }
+
     
     ret = snd_card_register(card);
 
@@ -313,13 +1101,60 @@ static struct platform_driver rpitx_driver =
 };
 
 
+/* Check the module parameters and apply them to both PCMs */
+static void set_buffer_geometry(void)
+{
+    /* One frame of I-Q is 4 bytes, keep whole mono frames too */
+    min_period_bytes = max(round_up(min_period_bytes, 4), 16);
+    max_period_bytes = max(round_up(max_period_bytes, 4), min_period_bytes);
+    max_periods = max(max_periods, 1);
+
+    rpitx_pcm_stereo_hw.period_bytes_min = min_period_bytes;
+    rpitx_pcm_stereo_hw.period_bytes_max = max_period_bytes * 2;
+    rpitx_pcm_stereo_hw.periods_max = max_periods;
+    rpitx_pcm_stereo_hw.buffer_bytes_max = MAX_BUFFER * 2;
+
+    rpitx_pcm_mono_hw.period_bytes_min = min_period_bytes / 2;
+    rpitx_pcm_mono_hw.period_bytes_max = max_period_bytes / 2;
+    rpitx_pcm_mono_hw.periods_max = max_periods;
+    rpitx_pcm_mono_hw.buffer_bytes_max = MAX_BUFFER / 2;
+
+    rpitx_pcm_monitor_hw.period_bytes_min = min_period_bytes;
+    rpitx_pcm_monitor_hw.period_bytes_max = max_period_bytes;
+    rpitx_pcm_monitor_hw.periods_max = max_periods;
+    rpitx_pcm_monitor_hw.buffer_bytes_max = MAX_BUFFER;
+
+    /* The FIFO holds at least a whole buffer of 32 bit I-Q, and whole pages */
+    fifo_bytes = roundup_pow_of_two(max_t(int, max_t(int, fifo_bytes, MAX_BUFFER * 2), PAGE_SIZE));
+
+    substreams = clamp(substreams, 1, RPITX_MAX_STREAMS / 2);
+    stream_count = 2 * substreams;
+}
+
 int rpitx_init_alsa_system(void)
 {
     int i, err, cards;
 
+    set_buffer_geometry();
+
+    shared_area = vmalloc_user(PAGE_SIZE * RPITX_MMAP_RING_PGOFF + stream_count * fifo_bytes);
+    if (!shared_area)
+        return -ENOMEM;
+
+    ring_control = shared_area;
+    ring_control->ring_bytes = fifo_bytes;
+    ring_control->streams = stream_count;
+
+    spin_lock_init(&vclock.lock);
+    spin_lock_init(&monitor.lock);
+    hrtimer_init(&vclock.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    vclock.timer.function = rpitx_clock_tick;
+
     err = platform_driver_register(&rpitx_driver);
-    if (err < 0)
+    if (err < 0) {
+        vfree(shared_area);
         return err;
+    }
 
     cards = 0;
     for (i = 0; i < SNDRV_CARDS; i++)
@@ -362,49 +1197,230 @@ void rpitx_unregister_alsa(void)
         platform_device_unregister(devices[i]);
 
     platform_driver_unregister(&rpitx_driver);
+    vfree(shared_area);
 }
 
-ssize_t rpitx_read_bytes_from_alsa_buffer(char *buffer, size_t len)
+/* Empty the FIFO for a new substream, whose samples are of the given kind */
+static void reset_fifo(struct rpitx_stream *stream, unsigned int mode, unsigned int format)
 {
-    unsigned long available_frames;
-    int err;
-    struct snd_pcm_substream *ss = NULL;
-    
-    /* Pick the correct structure, depending on the open device */
-    if (mydev->is_stereo_iq_open)
-        ss = mydev->stereo_iq_private_data.substream;
-    else if (mydev->is_mono_usb_open)
-        ss = mydev->mono_usb_private_data.substream;
-    else
-        return 0;
-    
-    /* We don't copy anything if the call doesn't ask for at least a period */
-    if (len < PERIOD_BYTES)
-        return 0;
-    
-    /* If the buffer is not full enough, we don't read. */
-    available_frames = snd_pcm_playback_hw_avail(ss->runtime);
-    if (available_frames < PERIOD_BYTES)
+    mutex_lock(&fifo_lock);
+    sample_fifo_reset(&stream->fifo);
+    if (mode == RPITX_RING_USB)
+        clear_iq_sample_generation(&stream->generator);
+    stream->control->mode = mode;
+    stream->control->format = format;
+    stream->control->produced = stream->fifo.head;
+    stream->control->consumed = stream->fifo.tail;
+    mutex_unlock(&fifo_lock);
+}
+
+/* As the mixer of the daemon: samples count once every running or
+ * draining stream has some, or, with none playing, as soon as any left
+ * over stream has some. Otherwise a stream stopped with samples left
+ * would wake the daemon for nothing until the running ones have more. */
+int rpitx_alsa_data_available(void)
+{
+    struct rpitx_stream *stream;
+    int i, playing = 0, all_playing = 1, any = 0, ready;
+
+    for (i = 0; i < stream_count; i++) {
+        stream = &mydev->streams[i];
+        ready = sample_fifo_fill(&stream->fifo) > 0;
+        if (stream->control->state == RPITX_STATE_RUNNING || stream->control->state == RPITX_STATE_DRAINING) {
+            playing = 1;
+            all_playing &= ready;
+        }
+        any |= ready;
+    }
+
+    return playing ? all_playing : any;
+}
+
+/* Bytes of one frame in the FIFO of a stream */
+static u32 frame_bytes_of(struct rpitx_stream *stream)
+{
+    if (stream->control->mode != RPITX_RING_IQ)
+        return 2;
+    return stream->control->format == RPITX_FORMAT_S16_LE ? 4 : 8;
+}
+
+/* Read one FIFO as I-Q pairs, with fifo_lock held */
+static ssize_t read_stream(struct rpitx_stream *stream, char __user *buffer, size_t len)
+{
+    const char *data;
+    u32 frame_bytes, out_bytes, bytes, part, done;
+    u64 start, elapsed;
+    int mirror = monitored(stream);
+    int ret;
+
+    /* Mono samples double into S16 I-Q, the others are copied as they are */
+    frame_bytes = frame_bytes_of(stream);
+    out_bytes = frame_bytes == 2 ? 4 : frame_bytes;
+    bytes = min_t(u32, sample_fifo_fill(&stream->fifo) / frame_bytes, len / out_bytes) * frame_bytes;
+    if (bytes == 0) {
+        stat_add(stream, RPITX_STAT_EMPTY_READS, 1);
         return 0;
+    }
 
-    buffer_hw_pointer %= MAX_BUFFER;
-    
-    /* We do the actual copy */
-    if (mydev->is_stereo_iq_open) {
-        err = copy_to_user(buffer,
-                           ss->runtime->dma_area + buffer_hw_pointer,
-                           PERIOD_BYTES);
-        buffer_hw_pointer += PERIOD_BYTES;
+    /* We do the actual copy, in two parts if it wraps around the FIFO */
+    for (done = 0; done < bytes; done += part) {
+        part = min(sample_fifo_peek(&stream->fifo, done, &data), bytes - done);
+        if (frame_bytes != 2) {
+            ret = copy_to_user(buffer + done, data, part) ? -EFAULT : 0;
+            if (!ret && mirror)
+                monitor_write(data, part, stream->control->format);
+        } else {
+            stream->generator.monitor = mirror;
+            start = ktime_get_ns();
+            ret = process_iq_period(&stream->generator, buffer + 2 * done, data, part / 2);
+            elapsed = ktime_get_ns() - start;
+            stat_add(stream, RPITX_STAT_HILBERT_NS, elapsed);
+            stat_max(stream, RPITX_STAT_HILBERT_MAX_NS, elapsed);
+        }
+        if (ret)
+            return ret;
+    }
+
+    sample_fifo_consume(&stream->fifo, bytes);
+    stream->control->consumed = stream->fifo.tail;
+    stat_add(stream, RPITX_STAT_BYTES_DELIVERED, bytes);
+    return bytes * out_bytes / frame_bytes;
+}
+
+ssize_t rpitx_read_bytes_from_alsa_buffer(char *buffer, size_t len)
+{
+    ssize_t ret = 0;
+    int i;
+
+    /* We don't copy anything if the call doesn't ask for at least one I-Q pair */
+    if (len < MAX_FRAME_BYTES)
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(&fifo_lock))
+        return -ERESTARTSYS;
+
+    for (i = 0; i < stream_count; i++) {
+        if (sample_fifo_fill(&mydev->streams[i].fifo) > 0) {
+            ret = read_stream(&mydev->streams[i], buffer, len);
+            break;
+        }
+    }
+
+    /* Nothing anywhere, that was an empty read for every open stream */
+    if (i == stream_count)
+        for (i = 0; i < stream_count; i++)
+            if (mydev->streams[i].control->mode != RPITX_RING_NONE)
+                stat_add(&mydev->streams[i], RPITX_STAT_EMPTY_READS, 1);
+
+    mutex_unlock(&fifo_lock);
+    return ret;
+}
+
+ssize_t rpitx_alsa_read_stream(unsigned int index, char __user *buffer, size_t len)
+{
+    ssize_t ret;
+
+    if (index >= stream_count || len < MAX_FRAME_BYTES)
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(&fifo_lock))
+        return -ERESTARTSYS;
+    ret = read_stream(&mydev->streams[index], buffer, len);
+    mutex_unlock(&fifo_lock);
+
+    return ret;
+}
+
+int rpitx_alsa_mmap(struct vm_area_struct *vma)
+{
+    /* The daemon only reads, the tails move through RPITX_IOC_CONSUME.
+     * The module trusts the control page, so it may not become writable
+     * through mprotect() either. */
+    if (vma->vm_pgoff != 0 || (vma->vm_flags & VM_WRITE))
+        return -EINVAL;
+#ifdef HAVE_VM_FLAGS_CLEAR
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    return remap_vmalloc_range(vma, shared_area, 0);
+}
+
+int rpitx_alsa_consume(unsigned int index, size_t bytes)
+{
+    struct rpitx_stream *stream;
+    const char *data;
+    u32 part, done;
+    int ret = 0;
+
+    if (index >= stream_count)
+        return -EINVAL;
+    stream = &mydev->streams[index];
+
+    mutex_lock(&fifo_lock);
+
+    if (stream->control->mode != RPITX_RING_IQ || bytes % frame_bytes_of(stream) || bytes > sample_fifo_fill(&stream->fifo)) {
+        ret = -EINVAL;
     } else {
-        process_iq_period(buffer,
-                          ss->runtime->dma_area + buffer_hw_pointer);
-        buffer_hw_pointer += PERIOD_BYTES / 2;
-        
+        /* The daemon read them in place, the monitor reads them there too */
+        if (monitored(stream)) {
+            for (done = 0; done < bytes; done += part) {
+                part = min_t(u32, sample_fifo_peek(&stream->fifo, done, &data), bytes - done);
+                monitor_write(data, part, stream->control->format);
+            }
+        }
+        sample_fifo_consume(&stream->fifo, bytes);
+        stream->control->consumed = stream->fifo.tail;
+        stat_add(stream, RPITX_STAT_BYTES_DELIVERED, bytes);
     }
-    
-    /* We tell ALSA we have emptied some of the buffer */
-    snd_pcm_period_elapsed(ss);
-    
-    return PERIOD_BYTES;
+
+    mutex_unlock(&fifo_lock);
+    return ret;
+}
+
+void rpitx_alsa_set_downstream_delay(unsigned int frames)
+{
+    downstream_frames = frames;
+}
+
+void rpitx_alsa_get_stream_info(struct rpitx_stream_info *info)
+{
+    info->streams = mydev->open_streams;
+    info->playing = READ_ONCE(vclock.running);
+    info->rate = stream_rate;
+    info->generation = atomic_read(&params_generation);
+}
+
+ssize_t rpitx_alsa_show_stat(enum rpitx_stat stat, char *buf)
+{
+    ssize_t len = 0;
+    int i;
+
+    if (!mydev)
+        return -ENODEV;
+
+    for (i = 0; i < stream_count; i++)
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s%lld", i ? " " : "",
+                         (long long)atomic64_read(&mydev->streams[i].stats[stat]));
+    len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+    return len;
 }
 
+void rpitx_alsa_reset_stats(void)
+{
+    int i, j;
+
+    if (!mydev)
+        return;
+
+    for (i = 0; i < stream_count; i++)
+        for (j = 0; j < RPITX_STAT_COUNT; j++)
+            atomic64_set(&mydev->streams[i].stats[j], 0);
+}
+
+unsigned int rpitx_alsa_params_generation(void)
+{
+    return atomic_read(&params_generation);
+}
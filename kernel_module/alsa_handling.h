@@ -2,9 +2,11 @@
  * rpitx_alsa module
  * Author: Kevin "felixzero" Guilloy, F4VQG
  * 
- * This file handles the ALSA PCM interface. It declares one device with 2 PCMs:
+ * This file handles the ALSA PCM interface. It declares one device with 3 PCMs:
  *  - number 0 is stereo only and takes I-Q samples
  *  - number 1 is mono only and takes (already pre-filtered) USB samples
+ *  - number 2 is capture only, and gives back the I-Q of one stream as the
+ *    daemon takes it
  * 
  * This file is licensed under GNU GPL v3.
  */
@@ -13,8 +15,34 @@
 #define ALSA_HANDLING_H
 
 #include <linux/string.h>
+#include <linux/wait.h>
+#include <linux/mm_types.h>
 
-#define PERIOD_BYTES 256
+#include "rpitx_ioctl.h"
+
+/* Counters kept for each stream, see /sys/devices/rpitx/stats/ */
+enum rpitx_stat
+{
+    RPITX_STAT_PERIODS,         /* Periods played by the virtual clock */
+    RPITX_STAT_BYTES_PLAYED,    /* Bytes of the application put in the FIFO */
+    RPITX_STAT_BYTES_DELIVERED, /* Bytes taken from the FIFO by the daemon */
+    RPITX_STAT_EMPTY_READS,     /* Reads that found the FIFO empty */
+    RPITX_STAT_UNDERRUNS,       /* Ticks where the application was late, and silence played */
+    RPITX_STAT_DROPPED_FRAMES,  /* Frames lost because the FIFO was full */
+    RPITX_STAT_MAX_FILL,        /* Most bytes ever waiting in the FIFO */
+    RPITX_STAT_HILBERT_NS,      /* Time spent generating Q, mono streams only */
+    RPITX_STAT_HILBERT_MAX_NS,  /* Longest single call */
+    RPITX_STAT_COUNT
+};
+
+/* Print one counter for every stream, separated by spaces. */
+ssize_t rpitx_alsa_show_stat(enum rpitx_stat stat, char *buf);
+
+/* Set all the counters back to 0. */
+void rpitx_alsa_reset_stats(void);
+
+/* Readers of /dev/rpitxin sleep here until the FIFO has samples for them. */
+extern wait_queue_head_t rpitx_read_wait;
 
 /* To be called at initialization of the module to init the sound devices. */
 int rpitx_init_alsa_system(void);
@@ -22,17 +50,42 @@ int rpitx_init_alsa_system(void);
 /* to be called at the release of the module to free resources. */
 void rpitx_unregister_alsa(void);
 
+/* Returns non-zero if the daemon can mix samples, see alsa_handling.c. */
+int rpitx_alsa_data_available(void);
+
 /* 
- * Read ALSA's buffer.
+ * Read the first FIFO holding samples.
  * buffer is the destination.
- * len is the size to read. It need to be at least PERIOD_BYTE long to
- * trigger read. Otherwises does nothing.
+ * len is the size to read. It need to be at least one I-Q pair long,
+ * otherwise -EINVAL is returned.
  * 
- * Will copy exactly PERIOD_BYTE bytes, if available.
- * Will return the number of byte read.
+ * Will copy as many I-Q pairs as are available and fit in len, mono
+ * samples being turned into I-Q on the way.
+ * Will return the number of byte read, or 0 if all FIFOs are empty.
  */
 ssize_t rpitx_read_bytes_from_alsa_buffer(char *buffer, size_t len);
 
+/* Same as above, for the FIFO of the given stream */
+ssize_t rpitx_alsa_read_stream(unsigned int index, char __user *buffer, size_t len);
+
+/* Map the control page and the FIFOs into the daemon, see rpitx_ioctl.h */
+int rpitx_alsa_mmap(struct vm_area_struct *vma);
+
+/* Release I-Q bytes of a FIFO that the daemon has read in place */
+int rpitx_alsa_consume(unsigned int index, size_t bytes);
+
+/* Mirror frames of S16 I-Q, generated from a mono stream, to the monitor */
+void rpitx_alsa_monitor_iq(const int16_t *iq, size_t frames);
+
+/* Frames queued after the FIFOs, counted in the delay reported to ALSA */
+void rpitx_alsa_set_downstream_delay(unsigned int frames);
+
+/* Fill info with the parameters of the open streams */
+void rpitx_alsa_get_stream_info(struct rpitx_stream_info *info);
+
+/* Counter bumped whenever the stream parameters or states change */
+unsigned int rpitx_alsa_params_generation(void);
+
 #endif
 
 
@@ -1,57 +1,232 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * This file converts real sample (USB) to complex I-Q
+ * using either a finite impulse response filter as an approximation
+ * of the Hilbert transform to generate the Q samples, or a pair of
+ * allpass IIR chains with a 90 degree phase difference.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
 #include "iq_sample_generation.h"
 
 #include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/uaccess.h>
+#include <linux/fixp-arith.h>
 #include <sound/pcm.h>
 
-#define NUMBER_OF_SAMPLES (PERIOD_BYTES / 2)
+#ifdef CONFIG_KERNEL_MODE_NEON
+#include <asm/neon.h>
+#include <asm/simd.h>
+#endif
+
+/* Periods are processed in chunks of at most that many samples */
+#define CHUNK_SAMPLES 256
 
-/* The FIR approximation of the Hilber transform is defined as:
+/* Engines, picked when the usbdata PCM is opened */
+#define HILBERT_ENGINE_FIR 0
+#define HILBERT_ENGINE_IIR 1
+
+static int hilbert_engine = HILBERT_ENGINE_FIR;
+module_param(hilbert_engine, int, 0644);
+MODULE_PARM_DESC(hilbert_engine, "Hilbert transform used by usbdata, applied at open: 0 = linear phase FIR (default), 1 = low latency IIR");
+
+/* The FIR approximation of the Hilbert transform is defined as:
  * out = h conv. in
  * 
  * With h(n) = 2 / (n*pi) with n odd
  * and h(n) = 0 with n even
-*/
-#define TWO_OVER_PI 41722 /* = 2 / pi * 2^16 */
-#define FIR_HILBERT(i, x) \
-    ( ((NUMBER_OF_SAMPLES - i) % 2 == 0) ? \
-        0 \
-        : (TWO_OVER_PI * (int32_t)x / (i - NUMBER_OF_SAMPLES)))
+ * 
+ * h is truncated to hilbert_taps odd taps on each side and Hann windowed.
+ * Only the non-zero taps are stored, in Q14, ordered so that coefficient k
+ * applies to sample 2k of the window. The filter delays I by
+ * 2 * hilbert_taps - 1 samples.
+ */
+#define TWO_OVER_PI_Q14 10430 /* = 2 / pi * 2^14 */
+#define COEFFICIENT_SHIFT 14
 
-/* This assumes the current implementation is *little endian*. */
-static int16_t period1[NUMBER_OF_SAMPLES], period2[NUMBER_OF_SAMPLES];
+static int hilbert_taps = 32;
+module_param(hilbert_taps, int, 0644);
+MODULE_PARM_DESC(hilbert_taps, "Odd taps on each side of the Hilbert FIR, multiple of 4 up to 64, applied at open (default: 32)");
 
-void clear_iq_sample_generation(void)
+/* The history is circular. Every sample is written twice, HISTORY_LENGTH
+ * apart, so that the last window is always contiguous in memory. The padding
+ * covers the NEON loads reading one sample past the window. */
+
+/* The IIR engine is made of two chains of second order allpass sections:
+ * y(n) = a * (x(n) + y(n - 2)) - x(n - 2)
+ * I is the output of the first chain, Q the output of the second one
+ * delayed by one sample. Their phase difference stays within a degree of
+ * 90 over nearly all the band, with a group delay of a few samples.
+ * (Squared coefficients by Olli Niemitalo, in Q30.)
+ */
+#define IIR_COEFFICIENT_SHIFT 30
+#define IIR_HEADROOM_SHIFT 12 /* Extra fractional bits kept in the states */
+
+static const int32_t iir_coefficients[2][IIR_SECTIONS] = {
+    {  173686865,  787083823, 1015061512, 1063647745 },
+    {  514752760,  940832443, 1048613677, 1071056671 },
+};
+
+/* Output of one chunk, before it is copied to user space */
+static int16_t iq_chunk[2 * CHUNK_SAMPLES];
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+#ifdef CONFIG_ARM64
+#define can_use_neon() may_use_simd()
+#else
+#define can_use_neon() (cpu_has_neon() && may_use_simd())
+#endif
+#else
+#define can_use_neon() 0
+#endif
+
+static void compute_coefficients(struct iq_generator *gen)
 {
-    memset(period1, 0, PERIOD_BYTES);
-    memset(period2, 0, PERIOD_BYTES);
+    int m, taps;
+    int32_t window, c;
+
+    taps = gen->taps = clamp(hilbert_taps, 4, MAX_HILBERT_TAPS) & ~3;
+
+    for (m = 0; m < taps; m++) {
+        /* Hann window, cos(pi * n / (2 * taps)) at n = 2m + 1, in Q31 */
+        window = 0x3fffffff + fixp_cos32_rad(2 * m + 1, 4 * taps) / 2;
+        c = (int32_t)(((int64_t)TWO_OVER_PI_Q14 * window) >> 31) / (2 * m + 1);
+
+        /* Past samples are added, future ones subtracted */
+        gen->coefficients[taps - 1 - m] = c;
+        gen->coefficients[taps + m] = -c;
+    }
 }
 
-void process_iq_period(char __user *out_buffer, const char *in_buffer)
+static int32_t hilbert_dot_product(const int16_t *window, const int16_t *coeffs, int count)
 {
-    int i, j;
-    int32_t q_sample;
-    
-    const int16_t *period3 = (int16_t*)in_buffer;
-    int16_t __user *iq_data = (int16_t*)out_buffer;
-    
-    for (i = 0; i < NUMBER_OF_SAMPLES; i++) {
-        q_sample = 0;
-        for (j = i; j < NUMBER_OF_SAMPLES; j++)
-            q_sample += FIR_HILBERT(j - i, period1[j]);
-        for (j = 0; j < NUMBER_OF_SAMPLES; j++)
-            q_sample += FIR_HILBERT(j - i + NUMBER_OF_SAMPLES, period2[j]);
-        for (j = 0; j < i; j++)
-            q_sample += FIR_HILBERT(j - i + 2 * NUMBER_OF_SAMPLES, period3[j]);
-        
-        put_user(period2[i], iq_data + 2 * i);
-        put_user((int16_t)((-q_sample) >> 16), iq_data + 2 * i + 1);
+    int32_t sum = 0;
+    int k;
+
+    for (k = 0; k < count; k++)
+        sum += coeffs[k] * window[2 * k];
+
+    return sum;
+}
+
+static int32_t allpass_chain(struct allpass_state *states, const int32_t *coeffs, int32_t x)
+{
+    int i;
+    int32_t y;
+
+    for (i = 0; i < IIR_SECTIONS; i++) {
+        y = (int32_t)(((int64_t)coeffs[i] * (x + states[i].y2)) >> IIR_COEFFICIENT_SHIFT)
+            - states[i].x2;
+        states[i].x2 = states[i].x1;
+        states[i].x1 = x;
+        states[i].y2 = states[i].y1;
+        states[i].y1 = y;
+        x = y;
     }
-    
-    for (i = 0; i < NUMBER_OF_SAMPLES; i++) {
-        period1[i] = period2[i];
-        period2[i] = period3[i];
+
+    return x;
+}
+
+static int16_t iir_output(int32_t sample)
+{
+    sample = (sample + (1 << (IIR_HEADROOM_SHIFT - 1))) >> IIR_HEADROOM_SHIFT;
+    return clamp_t(int32_t, sample, S16_MIN, S16_MAX);
+}
+
+void clear_iq_sample_generation(struct iq_generator *gen)
+{
+    gen->engine = hilbert_engine == HILBERT_ENGINE_IIR ? HILBERT_ENGINE_IIR : HILBERT_ENGINE_FIR;
+
+    compute_coefficients(gen);
+    memset(gen->history, 0, sizeof(gen->history));
+    gen->history_index = 0;
+
+    memset(gen->iir_states, 0, sizeof(gen->iir_states));
+    gen->iir_delayed_q = 0;
+}
+
+static void process_iir(struct iq_generator *gen, const int16_t *in, size_t count)
+{
+    size_t i;
+    int32_t x;
+
+    for (i = 0; i < count; i++) {
+        x = (int32_t)in[i] << IIR_HEADROOM_SHIFT;
+        iq_chunk[2 * i] = iir_output(allpass_chain(gen->iir_states[0], iir_coefficients[0], x));
+        iq_chunk[2 * i + 1] = iir_output(gen->iir_delayed_q);
+        gen->iir_delayed_q = allpass_chain(gen->iir_states[1], iir_coefficients[1], x);
+    }
+}
+
+static void process_fir(struct iq_generator *gen, const int16_t *in, size_t count)
+{
+    size_t i;
+    int32_t q_sample;
+    const int16_t *window;
+    int16_t *history = gen->history;
+    int taps = gen->taps;
+    int window_length = 4 * taps - 1;
+#ifdef CONFIG_KERNEL_MODE_NEON
+    int use_neon = can_use_neon();
+
+    if (use_neon)
+        kernel_neon_begin();
+#endif
+
+    for (i = 0; i < count; i++) {
+        history[gen->history_index] = in[i];
+        history[gen->history_index + HISTORY_LENGTH] = in[i];
+        window = history + gen->history_index + HISTORY_LENGTH - window_length + 1;
+        gen->history_index = (gen->history_index + 1) & (HISTORY_LENGTH - 1);
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+        if (use_neon)
+            q_sample = hilbert_dot_product_neon(window, gen->coefficients, 2 * taps);
+        else
+#endif
+            q_sample = hilbert_dot_product(window, gen->coefficients, 2 * taps);
+
+        q_sample = (q_sample + (1 << (COEFFICIENT_SHIFT - 1))) >> COEFFICIENT_SHIFT;
+        iq_chunk[2 * i] = window[2 * taps - 1];
+        iq_chunk[2 * i + 1] = clamp_t(int32_t, q_sample, S16_MIN, S16_MAX);
     }
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+    if (use_neon)
+        kernel_neon_end();
+#endif
 }
 
+int process_iq_period(struct iq_generator *gen, char __user *out_buffer,
+                      const char *in_buffer, size_t samples)
+{
+    size_t count;
+    const int16_t *in = (const int16_t *)in_buffer;
 
+    while (samples > 0) {
+        count = min_t(size_t, samples, CHUNK_SAMPLES);
+
+        if (gen->engine == HILBERT_ENGINE_IIR)
+            process_iir(gen, in, count);
+        else
+            process_fir(gen, in, count);
+
+        if (copy_to_user(out_buffer, iq_chunk, count * 2 * sizeof(int16_t)))
+            return -EFAULT;
+        if (gen->monitor)
+            rpitx_alsa_monitor_iq(iq_chunk, count);
+
+        in += count;
+        out_buffer += count * 2 * sizeof(int16_t);
+        samples -= count;
+    }
+
+    return 0;
+}
 
@@ -6,7 +6,7 @@
  * using a finite impulse response filter as an approximation
  * of the Hilbert transform to generate the Q samples.
  * 
- * This induces an extra latency of one buffer.
+ * This induces an extra latency of 2 * hilbert_taps - 1 samples.
  * 
  * This file is licensed under GNU GPL v3.
  */
@@ -14,16 +14,51 @@
 #ifndef IQ_SAMPLE_GENERATION_H
 #define IQ_SAMPLE_GENERATION_H
 
+#include <linux/types.h>
+
 #include "alsa_handling.h"
 
-/* Reset the saved buffers to a zero-ed state */
-void clear_iq_sample_generation(void);
+#define MAX_HILBERT_TAPS 64
+#define HISTORY_LENGTH 256 /* Power of two, at least 4 * MAX_HILBERT_TAPS */
+#define HISTORY_PADDING 16
+#define IIR_SECTIONS 4
+
+struct allpass_state
+{
+    int32_t x1, x2, y1, y2;
+};
+
+/* State of the conversion of one stream, see iq_sample_generation.c */
+struct iq_generator
+{
+    int engine;
+    int taps;
+    int16_t coefficients[2 * MAX_HILBERT_TAPS];
+    int16_t history[2 * HISTORY_LENGTH + HISTORY_PADDING];
+    unsigned int history_index;
+    struct allpass_state iir_states[2][IIR_SECTIONS];
+    int32_t iir_delayed_q;
+    int monitor;                /* Mirror the output to the monitor PCM */
+};
 
-/* Compute the Hilbert transform of one sample.
+/* Reset the history to a zero-ed state and reload the filter settings */
+void clear_iq_sample_generation(struct iq_generator *gen);
+
+/* Compute the Hilbert transform of one period of any length.
  * in_buffer is assumed to be a real buffer of S16_LE samples.
  * out_buffer is assumed to be a complex buffer of S16_LE * 2 samples.
- * in_buffer must be exactly PERIOD_BYTES and out_buffer double. */
-void process_iq_period(char __user *out_buffer, const char *in_buffer);
+ * Both hold the given number of samples. The output also goes to
+ * rpitx_alsa_monitor_iq() when gen->monitor is set.
+ * Calls must not run concurrently, even for different streams.
+ * Returns 0, or -EFAULT if out_buffer could not be written. */
+int process_iq_period(struct iq_generator *gen, char __user *out_buffer,
+                      const char *in_buffer, size_t samples);
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+/* Sum of coeffs[k] * window[2k] for k < count, count being a multiple of 8.
+ * Must be called between kernel_neon_begin() and kernel_neon_end(). */
+int32_t hilbert_dot_product_neon(const int16_t *window, const int16_t *coeffs, int count);
+#endif
 
 #endif
 
@@ -0,0 +1,37 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * NEON version of the Hilbert FIR inner loop.
+ * This file is built with NEON enabled, only when the kernel supports it.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include "iq_sample_generation.h"
+
+#ifdef CONFIG_ARM64
+#include <asm/neon-intrinsics.h>
+#else
+#include <arm_neon.h>
+#endif
+
+int32_t hilbert_dot_product_neon(const int16_t *window, const int16_t *coeffs, int count)
+{
+    int k;
+    int16x8x2_t samples;
+    int16x8_t taps;
+    int32x2_t pair;
+    int32x4_t sum = vdupq_n_s32(0);
+
+    /* vld2 splits even and odd samples, only the even ones have a tap */
+    for (k = 0; k < count; k += 8) {
+        samples = vld2q_s16(window + 2 * k);
+        taps = vld1q_s16(coeffs + k);
+        sum = vmlal_s16(sum, vget_low_s16(samples.val[0]), vget_low_s16(taps));
+        sum = vmlal_s16(sum, vget_high_s16(samples.val[0]), vget_high_s16(taps));
+    }
+
+    pair = vadd_s32(vget_low_s32(sum), vget_high_s32(sum));
+    return vget_lane_s32(vpadd_s32(pair, pair), 0);
+}
@@ -0,0 +1,120 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * This file describes the /dev/rpitxin interface shared between the
+ * kernel module and the daemon, on top of read().
+ * 
+ * Every playback substream of the module has its own FIFO, filled by the
+ * virtual playback clock, and the daemon mixes them all into one signal.
+ * 
+ * mmap() at offset 0 maps one control page, followed by the FIFOs one
+ * after the other, each ring_bytes long. The daemon reads I-Q samples in
+ * place and releases them with RPITX_IOC_CONSUME. Mono USB data must go
+ * through RPITX_IOC_READ instead, since the Q channel is generated at
+ * that point. Plain read() returns the samples of the first stream that
+ * has any, as I-Q pairs in the format of that stream, for simple clients
+ * handling a single stream.
+ * 
+ * The daemon reports with RPITX_IOC_SET_DELAY how many frames it still
+ * holds past the FIFOs, so that ALSA applications get an accurate delay.
+ * 
+ * poll() reports POLLPRI when the stream parameters (e.g. the sample rate
+ * negotiated by the applications) or the state of a stream have changed
+ * since the last RPITX_IOC_GET_STREAM_INFO on that file. The state follows
+ * the ALSA triggers, so the daemon can key up as soon as an application
+ * starts, and key down once the last sample of a drain is on the air.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#ifndef RPITX_IOCTL_H
+#define RPITX_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Page offset of the first FIFO in the mapping, the control page being first */
+#define RPITX_MMAP_RING_PGOFF 1
+
+/* Largest number of streams, whatever the module parameters */
+#define RPITX_MAX_STREAMS 16
+
+/* What a FIFO currently holds */
+#define RPITX_RING_NONE 0 /* Its PCM substream was never opened */
+#define RPITX_RING_IQ   1 /* Interleaved I-Q pairs in the format of the stream, readable in place */
+#define RPITX_RING_USB  2 /* Mono samples, use RPITX_IOC_READ */
+
+/* State of a stream, as set by the ALSA callbacks */
+#define RPITX_STATE_STOPPED  0 /* Prepared or stopped, its FIFO is not fed */
+#define RPITX_STATE_RUNNING  1
+#define RPITX_STATE_PAUSED   2
+#define RPITX_STATE_DRAINING 3 /* Still fed, until the application buffer is empty */
+
+/* Sample format of the I-Q pairs of a stream. Mono streams are S16 only. */
+#define RPITX_FORMAT_S16_LE   0
+#define RPITX_FORMAT_S32_LE   1
+#define RPITX_FORMAT_FLOAT_LE 2
+
+/*
+ * State of one stream. The counters are free-running byte counts: the FIFO
+ * offset is the counter modulo ring_bytes, and produced - consumed is the
+ * amount of data ready. 32 bits wide so they are atomic on arm.
+ */
+struct rpitx_stream_control
+{
+    __u32 mode;     /* RPITX_RING_* */
+    __u32 format;   /* RPITX_FORMAT_*, set before the first sample */
+    __u32 produced;
+    __u32 consumed;
+    __u32 state;    /* RPITX_STATE_* */
+    __s32 offset;   /* Frequency shift of the stream, in Hz */
+    __u32 gain;     /* In percent */
+};
+
+/* Control page */
+struct rpitx_ring_control
+{
+    __u32 ring_bytes; /* Size of each FIFO */
+    __u32 streams;    /* Number of FIFOs */
+    struct rpitx_stream_control stream[RPITX_MAX_STREAMS];
+};
+
+/* Parameters shared by the open streams */
+struct rpitx_stream_info
+{
+    __u32 streams;    /* Streams open */
+    __u32 playing;    /* Streams running or draining */
+    __u32 rate;       /* Sample rate in Hz, 0 until negotiated */
+    __u32 generation; /* Bumped whenever the parameters or a state change */
+};
+
+struct rpitx_consume
+{
+    __u32 stream;
+    __u32 bytes;
+};
+
+struct rpitx_read
+{
+    __u32 stream;
+    __u32 bytes;  /* Size of the buffer, twice the FIFO bytes it can take */
+    __u64 buffer; /* Where the I-Q pairs are written */
+};
+
+#define RPITX_IOC_MAGIC 'R'
+
+/* Release bytes of a FIFO that were read in place */
+#define RPITX_IOC_CONSUME _IOW(RPITX_IOC_MAGIC, 1, struct rpitx_consume)
+
+/* Get the parameters of the open streams, and clear POLLPRI */
+#define RPITX_IOC_GET_STREAM_INFO _IOR(RPITX_IOC_MAGIC, 2, struct rpitx_stream_info)
+
+/* Set the number of frames (passed by value) queued after the FIFOs */
+#define RPITX_IOC_SET_DELAY _IO(RPITX_IOC_MAGIC, 3)
+
+/* Read the samples of one stream as I-Q pairs in its format (S16 for mono
+ * streams), returns the bytes written */
+#define RPITX_IOC_READ _IOW(RPITX_IOC_MAGIC, 4, struct rpitx_read)
+
+#endif
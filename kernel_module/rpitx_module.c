@@ -11,6 +11,8 @@
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
 
 #include "alsa_handling.h"
 #include "sysfs_variable.h"
@@ -29,15 +31,47 @@ static int major_number;
 static struct class *chardev_class = NULL;
 static struct device *chardev = NULL;
 
+/* Each file remembers the last parameters generation it was told about */
+static unsigned int seen_generation(struct file *filep)
+{
+    return (unsigned int)(uintptr_t)filep->private_data;
+}
+
 static int dev_open(struct inode *inodep, struct file *filep)
 {
-    /* Nothing to do */
+    /* POLLPRI is raised right away, so the reader picks up the parameters */
+    filep->private_data = (void *)(uintptr_t)(rpitx_alsa_params_generation() - 1);
     return 0;
 }
 
 static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
 {
-    return rpitx_read_bytes_from_alsa_buffer(buffer, len);
+    ssize_t ret;
+
+    /* Sleep until the virtual clock puts samples in a FIFO, unless O_NONBLOCK */
+    while ((ret = rpitx_read_bytes_from_alsa_buffer(buffer, len)) == 0) {
+        if (filep->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        if (wait_event_interruptible(rpitx_read_wait, rpitx_alsa_data_available()))
+            return -ERESTARTSYS;
+    }
+
+    return ret;
+}
+
+static __poll_t dev_poll(struct file *filep, poll_table *wait)
+{
+    __poll_t mask = 0;
+
+    poll_wait(filep, &rpitx_read_wait, wait);
+
+    if (rpitx_alsa_data_available())
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (rpitx_alsa_params_generation() != seen_generation(filep))
+        mask |= EPOLLPRI;
+
+    return mask;
 }
 
 static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
@@ -46,6 +80,40 @@ static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, lof
     return -EINVAL;
 }
 
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+    return rpitx_alsa_mmap(vma);
+}
+
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+    struct rpitx_stream_info info;
+    struct rpitx_consume consume;
+    struct rpitx_read read;
+
+    switch (cmd) {
+    case RPITX_IOC_CONSUME:
+        if (copy_from_user(&consume, (void __user *)arg, sizeof(consume)))
+            return -EFAULT;
+        return rpitx_alsa_consume(consume.stream, consume.bytes);
+    case RPITX_IOC_READ:
+        if (copy_from_user(&read, (void __user *)arg, sizeof(read)))
+            return -EFAULT;
+        return rpitx_alsa_read_stream(read.stream, u64_to_user_ptr(read.buffer), read.bytes);
+    case RPITX_IOC_GET_STREAM_INFO:
+        rpitx_alsa_get_stream_info(&info);
+        if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+            return -EFAULT;
+        filep->private_data = (void *)(uintptr_t)info.generation;
+        return 0;
+    case RPITX_IOC_SET_DELAY:
+        rpitx_alsa_set_downstream_delay(arg);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
 static int dev_release(struct inode *inodep, struct file *filep)
 {
     /* Nothing to do */
@@ -57,6 +125,11 @@ static struct file_operations chardev_ops =
    .open = dev_open,
    .read = dev_read,
    .write = dev_write,
+   .poll = dev_poll,
+   .mmap = dev_mmap,
+   .unlocked_ioctl = dev_ioctl,
+   /* The structures have the same layout for 32 bit daemons */
+   .compat_ioctl = compat_ptr_ioctl,
    .release = dev_release,
 };
 
@@ -0,0 +1,95 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * This file implements the FIFO between the virtual playback clock and
+ * the daemon.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#include "sample_fifo.h"
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/compiler.h>
+#include <asm/barrier.h>
+
+void sample_fifo_init(struct sample_fifo *fifo, char *data, u32 size)
+{
+    fifo->data = data;
+    fifo->size = size;
+    sample_fifo_reset(fifo);
+}
+
+void sample_fifo_reset(struct sample_fifo *fifo)
+{
+    fifo->head = 0;
+    fifo->tail = 0;
+}
+
+u32 sample_fifo_fill(const struct sample_fifo *fifo)
+{
+    return READ_ONCE(fifo->head) - READ_ONCE(fifo->tail);
+}
+
+u32 sample_fifo_write(struct sample_fifo *fifo, const char *src, u32 bytes)
+{
+    u32 head = fifo->head;
+    u32 offset = head & (fifo->size - 1);
+    u32 first_part;
+
+    /* The consumer must be done with the space before we reuse it */
+    smp_mb();
+    bytes = min(bytes, fifo->size - (head - READ_ONCE(fifo->tail)));
+    first_part = min(bytes, fifo->size - offset);
+
+    memcpy(fifo->data + offset, src, first_part);
+    memcpy(fifo->data, src + first_part, bytes - first_part);
+
+    /* The data must be visible before the new head */
+    smp_wmb();
+    WRITE_ONCE(fifo->head, head + bytes);
+
+    return bytes;
+}
+
+u32 sample_fifo_write_silence(struct sample_fifo *fifo, u32 bytes)
+{
+    u32 head = fifo->head;
+    u32 offset = head & (fifo->size - 1);
+    u32 first_part;
+
+    smp_mb();
+    bytes = min(bytes, fifo->size - (head - READ_ONCE(fifo->tail)));
+    first_part = min(bytes, fifo->size - offset);
+
+    memset(fifo->data + offset, 0, first_part);
+    memset(fifo->data, 0, bytes - first_part);
+
+    smp_wmb();
+    WRITE_ONCE(fifo->head, head + bytes);
+
+    return bytes;
+}
+
+u32 sample_fifo_peek(const struct sample_fifo *fifo, u32 skip, const char **data)
+{
+    u32 fill = sample_fifo_fill(fifo);
+    u32 offset = (fifo->tail + skip) & (fifo->size - 1);
+
+    /* Pairs with the write barrier of the producer */
+    smp_rmb();
+    *data = fifo->data + offset;
+
+    if (skip >= fill)
+        return 0;
+    return min(fill - skip, fifo->size - offset);
+}
+
+void sample_fifo_consume(struct sample_fifo *fifo, u32 bytes)
+{
+    /* Reads of the data must be complete before the space is given back */
+    smp_mb();
+    WRITE_ONCE(fifo->tail, fifo->tail + bytes);
+}
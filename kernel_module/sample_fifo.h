@@ -0,0 +1,48 @@
+/*
+ * rpitx_alsa module
+ * Author: Kevin "felixzero" Guilloy, F4VQG
+ * 
+ * This file implements the FIFO between the virtual playback clock and
+ * the daemon. It is a byte ring whose size is a power of two, with
+ * free-running head and tail counters. There is one producer and one
+ * consumer, and they need no lock between them.
+ * 
+ * This file is licensed under GNU GPL v3.
+ */
+
+#ifndef SAMPLE_FIFO_H
+#define SAMPLE_FIFO_H
+
+#include <linux/types.h>
+
+struct sample_fifo
+{
+    char *data;
+    u32 size; /* Power of two */
+    u32 head; /* Bytes ever written */
+    u32 tail; /* Bytes ever read */
+};
+
+/* Use data, of size bytes (a power of two), as an empty FIFO. */
+void sample_fifo_init(struct sample_fifo *fifo, char *data, u32 size);
+
+/* Drop the content. Neither side may run concurrently. */
+void sample_fifo_reset(struct sample_fifo *fifo);
+
+/* Bytes ready to be read. */
+u32 sample_fifo_fill(const struct sample_fifo *fifo);
+
+/* Producer side: append up to bytes from src, returns how many fitted. */
+u32 sample_fifo_write(struct sample_fifo *fifo, const char *src, u32 bytes);
+
+/* Producer side: append up to bytes of zeros, returns how many fitted. */
+u32 sample_fifo_write_silence(struct sample_fifo *fifo, u32 bytes);
+
+/* Consumer side: points *data to the bytes found skip bytes after the
+ * tail, and returns how many of them are contiguous in memory. */
+u32 sample_fifo_peek(const struct sample_fifo *fifo, u32 skip, const char **data);
+
+/* Consumer side: release bytes, which must have been read. */
+void sample_fifo_consume(struct sample_fifo *fifo, u32 bytes);
+
+#endif
@@ -6,13 +6,22 @@
  * It defines the following:
  *  /sys/devices/rpitx/frequency --> rpitx center frequency in Hz
  * /sys/devices/rpitx/harmonic --> harmonic to use (default: 1)
+ * /sys/devices/rpitx/offset --> shift from the center frequency in Hz (default: 0)
+ * /sys/devices/rpitx/hang_time --> time the carrier stays on after a transmission, in ms (default: 500)
+ * /sys/devices/rpitx/stats/ --> read-only counters, one value per stream (see alsa_handling.h),
+ *                               and reset, which clears them all when written to
+ * 
+ * Writing to a file wakes up whoever poll()s it for POLLPRI, so the daemon
+ * does not need to read them over and over.
  * 
  * This file is licensed under GNU GPL v3.
  */
 
 #include "sysfs_variable.h"
+#include "alsa_handling.h"
 
 #include <linux/kobject.h>
+#include <linux/sysfs.h>
 #include <linux/fs.h>
 #include <linux/string.h>
 #include <linux/device.h>
@@ -24,6 +33,8 @@ static struct kobject *root_folder;
 
 static unsigned int frequency = 14000000;
 static unsigned int harmonic = 1;
+static int offset = 0;
+static unsigned int hang_time = 500;
 
 static ssize_t frequency_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
@@ -33,6 +44,7 @@ static ssize_t frequency_show(struct kobject *kobj, struct kobj_attribute *attr,
 static ssize_t frequency_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
 {
     sscanf(buf, "%du", &frequency);
+    sysfs_notify(kobj, NULL, attr->attr.name);
     return count;
 }
 
@@ -44,11 +56,91 @@ static ssize_t harmonic_show(struct kobject *kobj, struct kobj_attribute *attr,
 static ssize_t harmonic_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
 {
     sscanf(buf, "%du", &harmonic);
+    sysfs_notify(kobj, NULL, attr->attr.name);
+    return count;
+}
+
+static ssize_t offset_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%d\n", offset);
+}
+
+static ssize_t offset_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    sscanf(buf, "%d", &offset);
+    sysfs_notify(kobj, NULL, attr->attr.name);
+    return count;
+}
+
+static ssize_t hang_time_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%d\n", hang_time);
+}
+
+static ssize_t hang_time_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    sscanf(buf, "%du", &hang_time);
+    sysfs_notify(kobj, NULL, attr->attr.name);
     return count;
 }
 
 static struct kobj_attribute frequency_attr = __ATTR(frequency, 0664, frequency_show, frequency_store);
 static struct kobj_attribute harmonic_attr  = __ATTR(harmonic,  0664, harmonic_show,  harmonic_store);
+static struct kobj_attribute offset_attr    = __ATTR(offset,    0664, offset_show,    offset_store);
+static struct kobj_attribute hang_time_attr = __ATTR(hang_time, 0664, hang_time_show, hang_time_store);
+
+/* Statistics, each file showing one counter of the streams */
+struct stat_attribute
+{
+    struct kobj_attribute attr;
+    enum rpitx_stat stat;
+};
+
+#define STAT_ATTR(_name, _stat) \
+    static struct stat_attribute _name##_attr = { __ATTR(_name, 0444, stat_show, NULL), _stat }
+
+static ssize_t stat_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return rpitx_alsa_show_stat(container_of(attr, struct stat_attribute, attr)->stat, buf);
+}
+
+static ssize_t reset_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    rpitx_alsa_reset_stats();
+    return count;
+}
+
+STAT_ATTR(periods, RPITX_STAT_PERIODS);
+STAT_ATTR(bytes_played, RPITX_STAT_BYTES_PLAYED);
+STAT_ATTR(bytes_delivered, RPITX_STAT_BYTES_DELIVERED);
+STAT_ATTR(empty_reads, RPITX_STAT_EMPTY_READS);
+STAT_ATTR(underruns, RPITX_STAT_UNDERRUNS);
+STAT_ATTR(dropped_frames, RPITX_STAT_DROPPED_FRAMES);
+STAT_ATTR(max_fill, RPITX_STAT_MAX_FILL);
+STAT_ATTR(hilbert_ns, RPITX_STAT_HILBERT_NS);
+STAT_ATTR(hilbert_max_ns, RPITX_STAT_HILBERT_MAX_NS);
+static struct kobj_attribute reset_attr = __ATTR(reset, 0200, NULL, reset_store);
+
+static struct attribute *stats_attrs[] =
+{
+    &periods_attr.attr.attr,
+    &bytes_played_attr.attr.attr,
+    &bytes_delivered_attr.attr.attr,
+    &empty_reads_attr.attr.attr,
+    &underruns_attr.attr.attr,
+    &dropped_frames_attr.attr.attr,
+    &max_fill_attr.attr.attr,
+    &hilbert_ns_attr.attr.attr,
+    &hilbert_max_ns_attr.attr.attr,
+    &reset_attr.attr,
+    NULL,
+};
+
+static struct attribute_group stats_group =
+{
+    .name = "stats",
+    .attrs = stats_attrs,
+};
 
 int rpitx_init_sysfs_variables(void)
 {
@@ -61,6 +153,15 @@ int rpitx_init_sysfs_variables(void)
     if (err < 0)
         return err;
     err = sysfs_create_file(root_folder, &harmonic_attr.attr);
+    if (err < 0)
+        return err;
+    err = sysfs_create_file(root_folder, &offset_attr.attr);
+    if (err < 0)
+        return err;
+    err = sysfs_create_file(root_folder, &hang_time_attr.attr);
+    if (err < 0)
+        return err;
+    err = sysfs_create_group(root_folder, &stats_group);
     if (err < 0)
         return err;
     
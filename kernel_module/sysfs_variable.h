@@ -6,6 +6,10 @@
  * It defines the following:
  *  /sys/devices/rpitx/frequency --> rpitx center frequency in Hz
  * /sys/devices/rpitx/harmonic --> harmonic to use (default: 1)
+ * /sys/devices/rpitx/offset --> shift from the center frequency in Hz (default: 0)
+ * /sys/devices/rpitx/hang_time --> time the carrier stays on after a transmission, in ms (default: 500)
+ * /sys/devices/rpitx/stats/ --> read-only counters, one value per stream (see alsa_handling.h),
+ *                               and reset, which clears them all when written to
  * 
  * This file is licensed under GNU GPL v3.
  */